@@ -0,0 +1,364 @@
+// The MIT License (MIT)
+//
+// Copyright (C) Itay Grudev 2015 - 2021
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//
+// Benchmarks of SingleApplication with real processes. Started without
+// arguments the executable is the driver, which spawns copies of itself in one
+// of the peer roles and prints the results as JSON:
+//
+//   singleapplication_benchmark [--repetitions <n>] [--output <file>]
+//
+// Peer roles, all sharing the block derived from <key>:
+//
+//   --peer primary <key>                  runs until it receives "quit"
+//   --peer secondary <key>                hands off to the primary and exits
+//   --peer sender <key> <size> <count>    sends <count> messages of <size> bytes
+//   --peer stop <key>                     asks the primary to quit
+//
+
+#include "singleapplication.h"
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QProcessEnvironment>
+#include <QStringList>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+static constexpr int PeerTimeout = 30000;
+static constexpr qint64 SharedMemoryThreshold = 64 * 1024;
+static constexpr qint64 TotalPayloadBytes = Q_INT64_C(256) * 1024 * 1024;
+
+static const qint64 PayloadSizes[] = {
+    16, 256, 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024
+};
+
+static const int StormSizes[] = {8, 32};
+
+static SingleApplication::Options peerOptions()
+{
+    return SingleApplication::Mode::User | SingleApplication::Mode::ExtendedProtocol;
+}
+
+static void reply(const char *line, qint64 value)
+{
+    std::printf("%s %lld\n", line, static_cast<long long>(value));
+    std::fflush(stdout);
+}
+
+static int runPeer(int argc, char *argv[])
+{
+    const char *role = argv[2];
+    const QString key = QString::fromLocal8Bit(argv[3]);
+
+    if (std::strcmp(role, "primary") == 0) {
+        SingleApplication app(argc, argv, true, peerOptions(), PeerTimeout, key);
+        if (!app.isPrimary())
+            return EXIT_FAILURE;
+
+        QObject::connect(&app, &SingleApplication::receivedMessage, &app,
+                         [&app](quint32, const QByteArray &message){
+            if (message == QByteArrayLiteral("quit"))
+                app.quit();
+        });
+
+        reply("ready", app.startupTimings().total);
+        return app.exec();
+    }
+
+    if (std::strcmp(role, "secondary") == 0) {
+        // Exits from the constructor once the primary acknowledged it
+        SingleApplication app(argc, argv, false, peerOptions(), PeerTimeout, key);
+        return EXIT_FAILURE;
+    }
+
+    if (std::strcmp(role, "sender") == 0 && argc >= 6) {
+        const qint64 size = std::strtoll(argv[4], nullptr, 10);
+        const qint64 count = std::strtoll(argv[5], nullptr, 10);
+
+        SingleApplication app(argc, argv, true, peerOptions(), PeerTimeout, key);
+        if (app.isPrimary())
+            return EXIT_FAILURE;
+        app.setSharedMemoryThreshold(SharedMemoryThreshold);
+
+        const QByteArray payload(static_cast<int>(size), 'x');
+        QElapsedTimer time;
+        time.start();
+        for (qint64 i = 0; i < count; ++i) {
+            if (!app.sendMessage(payload, PeerTimeout))
+                return EXIT_FAILURE;
+        }
+        if (!app.flushMessages(PeerTimeout))
+            return EXIT_FAILURE;
+
+        reply("elapsed", time.nsecsElapsed());
+        return EXIT_SUCCESS;
+    }
+
+    if (std::strcmp(role, "stop") == 0) {
+        SingleApplication app(argc, argv, true, peerOptions(), PeerTimeout, key);
+        if (app.isPrimary())
+            return EXIT_FAILURE;
+        return app.sendMessage(QByteArrayLiteral("quit"), PeerTimeout) && app.flushMessages(PeerTimeout)
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
+    }
+
+    return EXIT_FAILURE;
+}
+
+class Driver
+{
+public:
+    explicit Driver(int repetitions) : repetitions(repetitions)
+    {
+        key = QStringLiteral("singleapplication-benchmark-%1").arg(QCoreApplication::applicationPid());
+    }
+
+    QJsonObject run()
+    {
+        QJsonArray results;
+
+        results.append(coldStartPrimary());
+        results.append(secondaryToExit());
+        for (const qint64 size : PayloadSizes)
+            results.append(throughput(size));
+        for (const int instances : StormSizes)
+            results.append(secondaryStorm(instances));
+
+        QJsonObject report;
+        report.insert(QStringLiteral("qtVersion"), QString::fromLatin1(qVersion()));
+        report.insert(QStringLiteral("timestamp"), QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+        report.insert(QStringLiteral("repetitions"), repetitions);
+        report.insert(QStringLiteral("results"), results);
+        return report;
+    }
+
+private:
+    QProcess *spawn(const QStringList &arguments) const
+    {
+        // The peers never show a window
+        QProcessEnvironment environment = QProcessEnvironment::systemEnvironment();
+        environment.insert(QStringLiteral("QT_QPA_PLATFORM"), QStringLiteral("offscreen"));
+
+        auto *process = new QProcess();
+        process->setProcessEnvironment(environment);
+        process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        process->start(QCoreApplication::applicationFilePath(),
+                       QStringList{QStringLiteral("--peer")} + arguments);
+        return process;
+    }
+
+    static qint64 readReply(QProcess *process, const char *line)
+    {
+        const QByteArray prefix = QByteArray(line) + ' ';
+        while (process->canReadLine() || process->waitForReadyRead(PeerTimeout)) {
+            if (!process->canReadLine())
+                continue;
+            const QByteArray response = process->readLine().trimmed();
+            if (response.startsWith(prefix))
+                return response.mid(prefix.size()).toLongLong();
+        }
+        return -1;
+    }
+
+    static bool finish(QProcess *process)
+    {
+        const bool ok = process->waitForFinished(PeerTimeout) && process->exitStatus() == QProcess::NormalExit
+                        && process->exitCode() == EXIT_SUCCESS;
+        delete process;
+        return ok;
+    }
+
+    QProcess *startPrimary(qint64 *ready = nullptr, qint64 *startup = nullptr) const
+    {
+        QElapsedTimer time;
+        time.start();
+        QProcess *primary = spawn({QStringLiteral("primary"), key});
+        const qint64 total = readReply(primary, "ready");
+        if (ready != nullptr)
+            *ready = total < 0 ? -1 : time.nsecsElapsed();
+        if (startup != nullptr)
+            *startup = total;
+        return primary;
+    }
+
+    bool stopPrimary(QProcess *primary) const
+    {
+        const bool stopped = finish(spawn({QStringLiteral("stop"), key}));
+        return finish(primary) && stopped;
+    }
+
+    static QJsonObject summary(const QString &name, std::vector<qint64> samples)
+    {
+        QJsonObject result;
+        result.insert(QStringLiteral("name"), name);
+        result.insert(QStringLiteral("unit"), QStringLiteral("ns"));
+
+        QJsonArray values;
+        for (const qint64 sample : samples)
+            values.append(static_cast<double>(sample));
+        result.insert(QStringLiteral("samples"), values);
+
+        samples.erase(std::remove(samples.begin(), samples.end(), -1), samples.end());
+        result.insert(QStringLiteral("failures"), static_cast<int>(values.size()) - static_cast<int>(samples.size()));
+        if (!samples.empty()) {
+            std::sort(samples.begin(), samples.end());
+            result.insert(QStringLiteral("min"), static_cast<double>(samples.front()));
+            result.insert(QStringLiteral("median"), static_cast<double>(samples[samples.size() / 2]));
+            result.insert(QStringLiteral("max"), static_cast<double>(samples.back()));
+        }
+        return result;
+    }
+
+    // From spawning the first process until its constructor returned
+    QJsonObject coldStartPrimary() const
+    {
+        std::vector<qint64> ready;
+        std::vector<qint64> startup;
+        for (int i = 0; i < repetitions; ++i) {
+            qint64 readyTime = -1;
+            qint64 startupTime = -1;
+            QProcess *primary = startPrimary(&readyTime, &startupTime);
+            if (!stopPrimary(primary))
+                readyTime = startupTime = -1;
+            ready.push_back(readyTime);
+            startup.push_back(startupTime);
+        }
+
+        QJsonObject result = summary(QStringLiteral("cold_start_primary"), ready);
+        result.insert(QStringLiteral("constructor"), summary(QStringLiteral("constructor"), startup));
+        return result;
+    }
+
+    // From spawning a secondary until it handed off and exited
+    QJsonObject secondaryToExit() const
+    {
+        std::vector<qint64> samples;
+        QProcess *primary = startPrimary();
+        for (int i = 0; i < repetitions; ++i) {
+            QElapsedTimer time;
+            time.start();
+            const bool ok = finish(spawn({QStringLiteral("secondary"), key}));
+            samples.push_back(ok ? time.nsecsElapsed() : -1);
+        }
+        stopPrimary(primary);
+
+        return summary(QStringLiteral("secondary_to_exit"), samples);
+    }
+
+    QJsonObject throughput(qint64 size) const
+    {
+        const qint64 count = qBound<qint64>(4, TotalPayloadBytes / size, 10000);
+
+        std::vector<qint64> samples;
+        QProcess *primary = startPrimary();
+        for (int i = 0; i < repetitions; ++i) {
+            QProcess *sender = spawn({QStringLiteral("sender"), key, QString::number(size), QString::number(count)});
+            const qint64 elapsed = readReply(sender, "elapsed");
+            samples.push_back(finish(sender) ? elapsed : -1);
+        }
+        stopPrimary(primary);
+
+        QJsonObject result = summary(QStringLiteral("throughput"), samples);
+        result.insert(QStringLiteral("payloadBytes"), static_cast<double>(size));
+        result.insert(QStringLiteral("messages"), static_cast<double>(count));
+        if (result.contains(QStringLiteral("median"))) {
+            const double seconds = result.value(QStringLiteral("median")).toDouble() / 1e9;
+            result.insert(QStringLiteral("messagesPerSecond"), static_cast<double>(count) / seconds);
+            result.insert(QStringLiteral("megabytesPerSecond"),
+                          static_cast<double>(count * size) / (1024.0 * 1024.0) / seconds);
+        }
+        return result;
+    }
+
+    // Concurrent secondaries, from spawning the first until the last exited
+    QJsonObject secondaryStorm(int instances) const
+    {
+        std::vector<qint64> samples;
+        QProcess *primary = startPrimary();
+        for (int i = 0; i < repetitions; ++i) {
+            QElapsedTimer time;
+            time.start();
+            std::vector<QProcess *> secondaries;
+            for (int j = 0; j < instances; ++j)
+                secondaries.push_back(spawn({QStringLiteral("secondary"), key}));
+            bool ok = true;
+            for (QProcess *secondary : secondaries)
+                ok = finish(secondary) && ok;
+            samples.push_back(ok ? time.nsecsElapsed() : -1);
+        }
+        stopPrimary(primary);
+
+        QJsonObject result = summary(QStringLiteral("secondary_storm"), samples);
+        result.insert(QStringLiteral("instances"), instances);
+        return result;
+    }
+
+    int repetitions = 0;
+    QString key = {};
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 4 && std::strcmp(argv[1], "--peer") == 0)
+        return runPeer(argc, argv);
+
+    QCoreApplication app(argc, argv);
+
+    int repetitions = 5;
+    QString output;
+    const QStringList arguments = app.arguments();
+    for (int i = 1; i < arguments.size(); ++i) {
+        if (arguments.at(i) == QStringLiteral("--repetitions") && i + 1 < arguments.size()) {
+            repetitions = qMax(1, arguments.at(++i).toInt());
+        } else if (arguments.at(i) == QStringLiteral("--output") && i + 1 < arguments.size()) {
+            output = arguments.at(++i);
+        } else {
+            std::fprintf(stderr, "Usage: %s [--repetitions <n>] [--output <file>]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    Driver driver(repetitions);
+    const QByteArray report = QJsonDocument(driver.run()).toJson();
+
+    if (output.isEmpty()) {
+        std::fwrite(report.constData(), 1, static_cast<size_t>(report.size()), stdout);
+        return EXIT_SUCCESS;
+    }
+
+    QFile file(output);
+    if (!file.open(QIODevice::WriteOnly) || file.write(report) != report.size()) {
+        std::fprintf(stderr, "Unable to write %s\n", qPrintable(output));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,660 @@
+// The MIT License (MIT)
+//
+// Copyright (C) Itay Grudev 2015 - 2021
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//
+// Stress and fuzz test of the primary instance. Started without a peer role
+// the executable is the driver. It starts a primary and then, all at once,
+// hundreds of senders with random message sizes and a random mix of modes,
+// some of which exit abruptly, and fuzzers writing truncated and garbage
+// frames, with lengths up to the largest a header can declare, straight to the
+// socket. The primary limits what it buffers with a receive budget and streams
+// the messages above half of it, which may exceed the budget.
+// The report is printed as JSON and the exit code is non-zero if a message
+// was lost, duplicated or corrupted, or the primary didn't survive:
+//
+//   singleapplication_stress [--senders <n>] [--messages <n>] [--max-size <bytes>]
+//                            [--fuzzers <n>] [--abort-percent <n>] [--seed <n>]
+//                            [--receive-budget <bytes>] [--output <file>]
+//
+// The default maximum size exceeds half of the shared memory channel, so large
+// messages have to wait for room in it. The default receive budget is half of
+// the maximum size, so socket only senders exceed it. A receive budget of 0
+// disables it and streaming, otherwise it is the budget of a connection and a
+// quarter of the total.
+//
+// Peer roles:
+//
+//   --peer primary <key> <budget>                          records what it receives
+//   --peer sender <key> <index> <count> <max size> <seed> <abort> <modes>
+//   --peer fuzz <server name> <seed>                       writes broken frames
+//   --peer report <key> <bounds file>                      makes the primary report
+//
+
+#include "singleapplication.h"
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocalSocket>
+#include <QProcess>
+#include <QProcessEnvironment>
+#include <QRandomGenerator>
+#include <QSet>
+#include <QStringList>
+#include <QTemporaryFile>
+#include <QThread>
+#include <QtEndian>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(Q_OS_WINDOWS)
+#include <qt_windows.h>
+#include <psapi.h>
+#elif defined(Q_OS_UNIX)
+#include <sys/resource.h>
+#endif
+
+static constexpr int PeerTimeout = 60000;
+static constexpr qint64 SharedMemoryThreshold = 64 * 1024;
+static constexpr int FlushInterval = 8;
+static constexpr int AbortExitCode = 3;
+static constexpr quint64 MaximumFrameLength = (Q_UINT64_C(1) << 56) - 1;
+
+// The modes a sender combines, picked at random for every sender
+enum SenderMode : quint32 {
+    IpcThreadSender = 1 << 0,
+    ChannelSender = 1 << 1,
+    SocketOnlySender = 1 << 2,
+    AllSenderModes = (1 << 3) - 1
+};
+static const QString StressChannel = QStringLiteral("stress");
+
+// Every message starts with a header the primary checks, the rest is filled
+// with a byte derived from the sequence number
+static constexpr char PayloadMagic[4] = {'S', 'T', 'R', 'S'};
+static constexpr int PayloadHeaderSize = 24;
+
+static SingleApplication::Options peerOptions(quint32 modes = 0)
+{
+    SingleApplication::Options options = SingleApplication::Mode::User | SingleApplication::Mode::ExtendedProtocol;
+    if (modes & IpcThreadSender)
+        options |= SingleApplication::Mode::IpcThread;
+    return options;
+}
+
+static void reply(const char *line, qint64 value)
+{
+    std::printf("%s %lld\n", line, static_cast<long long>(value));
+    std::fflush(stdout);
+}
+
+static void replyText(const char *line, const QByteArray &text)
+{
+    std::printf("%s %s\n", line, text.constData());
+    std::fflush(stdout);
+}
+
+// The steady clock is system wide on the supported platforms, so send and
+// receive times of different processes can be compared
+static qint64 steadyNow()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static qint64 peakMemory()
+{
+#if defined(Q_OS_WINDOWS)
+    PROCESS_MEMORY_COUNTERS counters = {};
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return -1;
+    return static_cast<qint64>(counters.PeakWorkingSetSize);
+#elif defined(Q_OS_UNIX)
+    struct rusage usage = {};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+#if defined(Q_OS_MACOS)
+    return static_cast<qint64>(usage.ru_maxrss);
+#else
+    return static_cast<qint64>(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return -1;
+#endif
+}
+
+static char fillByte(quint32 sequence)
+{
+    return static_cast<char>('a' + sequence % 26);
+}
+
+static QByteArray payload(quint32 sender, quint32 sequence, qint64 size)
+{
+    QByteArray message(static_cast<int>(qMax<qint64>(size, PayloadHeaderSize)), fillByte(sequence));
+    char *data = message.data();
+    memcpy(data, PayloadMagic, sizeof(PayloadMagic));
+    qToLittleEndian(sender, data + 4);
+    qToLittleEndian(sequence, data + 8);
+    qToLittleEndian(static_cast<quint32>(message.size()), data + 12);
+    qToLittleEndian(steadyNow(), data + 16);
+    return message;
+}
+
+static qint64 percentile(const std::vector<qint64> &sorted, double fraction)
+{
+    if (sorted.empty())
+        return -1;
+    const auto index = static_cast<size_t>(static_cast<double>(sorted.size() - 1) * fraction);
+    return sorted[index];
+}
+
+class Recorder
+{
+public:
+    void record(const QByteArray &message)
+    {
+        const qint64 now = steadyNow();
+        const char *data = message.constData();
+        if (message.size() < PayloadHeaderSize || memcmp(data, PayloadMagic, sizeof(PayloadMagic)) != 0) {
+            ++corrupted;
+            return;
+        }
+
+        const auto sender = qFromLittleEndian<quint32>(data + 4);
+        const auto sequence = qFromLittleEndian<quint32>(data + 8);
+        const auto size = qFromLittleEndian<quint32>(data + 12);
+        const auto sent = qFromLittleEndian<qint64>(data + 16);
+        const char fill = fillByte(sequence);
+        if (size != static_cast<quint32>(message.size())
+            || std::any_of(data + PayloadHeaderSize, data + message.size(), [fill](char c){ return c != fill; })) {
+            ++corrupted;
+            return;
+        }
+
+        QSet<quint32> &received = sequences[sender];
+        if (received.contains(sequence)) {
+            ++duplicated;
+            return;
+        }
+        received.insert(sequence);
+
+        if (firstReceived < 0)
+            firstReceived = now;
+        lastReceived = now;
+        bytes += message.size();
+        latencies.push_back(now - sent);
+    }
+
+    // bounds holds "<sender> <messages>" lines, the messages each sender is
+    // known to have delivered
+    QJsonObject report(const QString &boundsPath)
+    {
+        qint64 expected = 0;
+        qint64 lost = 0;
+        QFile bounds(boundsPath);
+        if (bounds.open(QIODevice::ReadOnly)) {
+            while (!bounds.atEnd()) {
+                const QList<QByteArray> fields = bounds.readLine().trimmed().split(' ');
+                if (fields.size() != 2)
+                    continue;
+                const quint32 sender = fields.at(0).toUInt();
+                const quint32 delivered = fields.at(1).toUInt();
+                const QSet<quint32> received = sequences.value(sender);
+                expected += delivered;
+                for (quint32 sequence = 0; sequence < delivered; ++sequence) {
+                    if (!received.contains(sequence))
+                        ++lost;
+                }
+            }
+        }
+
+        qint64 received = 0;
+        for (const QSet<quint32> &senderSequences : std::as_const(sequences))
+            received += senderSequences.size();
+
+        std::sort(latencies.begin(), latencies.end());
+        QJsonObject latency;
+        latency.insert(QStringLiteral("unit"), QStringLiteral("ns"));
+        latency.insert(QStringLiteral("median"), static_cast<double>(percentile(latencies, 0.5)));
+        latency.insert(QStringLiteral("p99"), static_cast<double>(percentile(latencies, 0.99)));
+        latency.insert(QStringLiteral("p999"), static_cast<double>(percentile(latencies, 0.999)));
+        latency.insert(QStringLiteral("max"), static_cast<double>(latencies.empty() ? -1 : latencies.back()));
+
+        QJsonObject result;
+        result.insert(QStringLiteral("expected"), static_cast<double>(expected));
+        result.insert(QStringLiteral("received"), static_cast<double>(received));
+        result.insert(QStringLiteral("lost"), static_cast<double>(lost));
+        result.insert(QStringLiteral("duplicated"), static_cast<double>(duplicated));
+        result.insert(QStringLiteral("corrupted"), static_cast<double>(corrupted));
+        result.insert(QStringLiteral("bytes"), static_cast<double>(bytes));
+        result.insert(QStringLiteral("latency"), latency);
+        if (lastReceived > firstReceived) {
+            const double seconds = static_cast<double>(lastReceived - firstReceived) / 1e9;
+            result.insert(QStringLiteral("messagesPerSecond"), static_cast<double>(received) / seconds);
+            result.insert(QStringLiteral("megabytesPerSecond"), static_cast<double>(bytes) / (1024.0 * 1024.0) / seconds);
+        }
+        result.insert(QStringLiteral("peakMemory"), static_cast<double>(peakMemory()));
+        return result;
+    }
+
+private:
+    QHash<quint32, QSet<quint32>> sequences = {};
+    std::vector<qint64> latencies = {};
+    qint64 duplicated = 0;
+    qint64 corrupted = 0;
+    qint64 bytes = 0;
+    qint64 firstReceived = -1;
+    qint64 lastReceived = -1;
+};
+
+static int runSender(int argc, char *argv[], const QString &key)
+{
+    const auto index = static_cast<quint32>(std::strtoul(argv[4], nullptr, 10));
+    const qint64 count = std::strtoll(argv[5], nullptr, 10);
+    const qint64 maxSize = qMax<qint64>(PayloadHeaderSize, std::strtoll(argv[6], nullptr, 10));
+    QRandomGenerator random(static_cast<quint32>(std::strtoul(argv[7], nullptr, 10)));
+    const bool abort = std::strcmp(argv[8], "1") == 0;
+    const auto modes = static_cast<quint32>(std::strtoul(argv[9], nullptr, 10));
+
+    SingleApplication app(argc, argv, true, peerOptions(modes), PeerTimeout, key);
+    if (app.isPrimary())
+        return EXIT_FAILURE;
+    app.setSharedMemoryThreshold(modes & SocketOnlySender ? 0 : SharedMemoryThreshold);
+
+    // An aborting sender drops the connection with messages in flight
+    const qint64 abortAfter = abort ? random.bounded(static_cast<int>(count)) : -1;
+    for (qint64 i = 0; i < count; ++i) {
+        if (i == abortAfter) {
+            reply("peak", peakMemory());
+            std::_Exit(AbortExitCode);
+        }
+
+        // Log uniform, so small and large messages are equally represented
+        const auto size = static_cast<qint64>(std::exp(random.generateDouble() * std::log(static_cast<double>(maxSize))));
+        const QByteArray message = payload(index, static_cast<quint32>(i), size);
+        const bool sent = modes & ChannelSender ? app.sendChannelMessage(StressChannel, message, PeerTimeout)
+                                                : app.sendMessage(message, PeerTimeout);
+        if (!sent)
+            return EXIT_FAILURE;
+
+        if ((i + 1) % FlushInterval == 0 || i + 1 == count) {
+            if (!app.flushMessages(PeerTimeout))
+                return EXIT_FAILURE;
+            reply("flushed", i + 1);
+        }
+    }
+
+    reply("peak", peakMemory());
+    return EXIT_SUCCESS;
+}
+
+static int runFuzzer(const QString &serverName, quint32 seed)
+{
+    QRandomGenerator random(seed);
+    QLocalSocket socket;
+    socket.connectToServer(serverName);
+    if (!socket.waitForConnected(PeerTimeout))
+        return EXIT_FAILURE;
+
+    // Frames of a random length, written in random pieces and often cut
+    // short, with the musings of a random number generator as contents. Some
+    // declare large lengths up to the largest a header holds, only the start
+    // of which is written.
+    const int frames = random.bounded(1, 5);
+    for (int frame = 0; frame < frames; ++frame) {
+        quint64 length = 0;
+        const int kind = random.bounded(8);
+        if (kind == 7)
+            length = MaximumFrameLength - static_cast<quint64>(random.bounded(4096));
+        else if (kind == 6)
+            length = static_cast<quint64>(random.bounded(64 * 1024, 256 * 1024 * 1024));
+        else
+            length = static_cast<quint64>(random.bounded(64 * 1024));
+        const auto body = static_cast<int>(qMin<quint64>(length, 64 * 1024));
+        const auto flags = static_cast<quint64>(random.bounded(256)) << 56;
+        QByteArray data(8, Qt::Uninitialized);
+        qToBigEndian(length | flags, data.data());
+        data.resize(8 + body);
+        for (int i = 8; i < data.size(); ++i)
+            data[i] = static_cast<char>(random.bounded(256));
+
+        const auto size = static_cast<int>(data.size());
+        const bool truncate = static_cast<quint64>(body) < length || random.bounded(2) == 0;
+        const int end = truncate ? random.bounded(size) : size;
+        for (int written = 0; written < end;) {
+            const int piece = qMin(end - written, random.bounded(1, 4097));
+            socket.write(data.constData() + written, piece);
+            written += piece;
+            if (!socket.waitForBytesWritten(PeerTimeout) && socket.state() != QLocalSocket::ConnectedState)
+                return EXIT_SUCCESS;
+            QThread::msleep(static_cast<unsigned long>(random.bounded(3)));
+        }
+        if (truncate)
+            break;
+    }
+
+    socket.abort();
+    return EXIT_SUCCESS;
+}
+
+static int runPeer(int argc, char *argv[])
+{
+    const char *role = argv[2];
+    const QString key = QString::fromLocal8Bit(argv[3]);
+
+    if (std::strcmp(role, "primary") == 0 && argc >= 5) {
+        SingleApplication app(argc, argv, true, peerOptions(), PeerTimeout, key);
+        if (!app.isPrimary())
+            return EXIT_FAILURE;
+        const qint64 budget = std::strtoll(argv[4], nullptr, 10);
+        app.setReceiveBudget(budget, 4 * budget);
+        app.setStreamingThreshold(budget / 2);
+
+        Recorder recorder;
+        QHash<quint64, QByteArray> streams;
+        QObject::connect(&app, &SingleApplication::messageStarted, &app,
+                         [&streams](quint32, quint64 streamId, qint64 length){
+            streams[streamId].reserve(static_cast<int>(length));
+        });
+        QObject::connect(&app, &SingleApplication::messageChunk, &app,
+                         [&streams](quint64 streamId, const QByteArray &chunk){
+            streams[streamId].append(chunk.constData(), chunk.size());
+        }, Qt::DirectConnection);
+        // An aborting sender leaves its last message incomplete
+        QObject::connect(&app, &SingleApplication::messageFinished, &app,
+                         [&streams, &recorder](quint64 streamId, bool complete){
+            const QByteArray message = streams.take(streamId);
+            if (complete)
+                recorder.record(message);
+        });
+        QObject::connect(&app, &SingleApplication::receivedMessage, &app,
+                         [&app, &recorder](quint32, const QByteArray &message){
+            if (message.startsWith("report ")) {
+                const QString bounds = QString::fromLocal8Bit(message.mid(7));
+                replyText("report", QJsonDocument(recorder.report(bounds)).toJson(QJsonDocument::Compact));
+                app.quit();
+                return;
+            }
+            recorder.record(message);
+        });
+        QObject::connect(&app, &SingleApplication::receivedChannelMessage, &app,
+                         [&recorder](quint32, const QString &, const QByteArray &message){
+            recorder.record(message);
+        });
+
+        replyText("server", app.blockServerName().toLocal8Bit());
+        return app.exec();
+    }
+
+    if (std::strcmp(role, "sender") == 0 && argc >= 10)
+        return runSender(argc, argv, key);
+
+    if (std::strcmp(role, "fuzz") == 0 && argc >= 5) {
+        QCoreApplication app(argc, argv);
+        return runFuzzer(key, static_cast<quint32>(std::strtoul(argv[4], nullptr, 10)));
+    }
+
+    if (std::strcmp(role, "report") == 0 && argc >= 5) {
+        SingleApplication app(argc, argv, true, peerOptions(), PeerTimeout, key);
+        if (app.isPrimary())
+            return EXIT_FAILURE;
+        return app.sendMessage(QByteArray("report ") + argv[4], PeerTimeout) && app.flushMessages(PeerTimeout)
+                   ? EXIT_SUCCESS
+                   : EXIT_FAILURE;
+    }
+
+    return EXIT_FAILURE;
+}
+
+struct StressOptions
+{
+    int senders = 200;
+    int messages = 50;
+    qint64 maxSize = 6 * 1024 * 1024;
+    int fuzzers = 20;
+    int abortPercent = 20;
+    quint32 seed = 0;
+    qint64 receiveBudget = maxSize / 2;
+};
+
+class Driver
+{
+public:
+    explicit Driver(const StressOptions &options) : options(options)
+    {
+        key = QStringLiteral("singleapplication-stress-%1").arg(QCoreApplication::applicationPid());
+    }
+
+    QJsonObject run(bool &ok)
+    {
+        QJsonObject report;
+        report.insert(QStringLiteral("qtVersion"), QString::fromLatin1(qVersion()));
+        report.insert(QStringLiteral("timestamp"), QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+        report.insert(QStringLiteral("seed"), static_cast<double>(options.seed));
+        report.insert(QStringLiteral("senders"), options.senders);
+        report.insert(QStringLiteral("messagesPerSender"), options.messages);
+        report.insert(QStringLiteral("maxSize"), static_cast<double>(options.maxSize));
+        report.insert(QStringLiteral("fuzzers"), options.fuzzers);
+        report.insert(QStringLiteral("receiveBudget"), static_cast<double>(options.receiveBudget));
+        ok = false;
+
+        QProcess *primary = spawn({QStringLiteral("primary"), key, QString::number(options.receiveBudget)});
+        const QByteArray serverName = readLine(primary, "server");
+        if (serverName.isEmpty()) {
+            finish(primary);
+            report.insert(QStringLiteral("error"), QStringLiteral("The primary instance didn't start"));
+            return report;
+        }
+
+        // What every sender has delivered for sure, an aborting one only up
+        // to its last flush
+        QTemporaryFile bounds;
+        if (!bounds.open()) {
+            primary->kill();
+            finish(primary);
+            report.insert(QStringLiteral("error"), QStringLiteral("Unable to create the bounds file"));
+            return report;
+        }
+
+        QRandomGenerator random(options.seed);
+        std::vector<QProcess *> senders;
+        std::vector<bool> aborting;
+        std::vector<QProcess *> fuzzers;
+        QJsonObject modeCounts;
+        QElapsedTimer time;
+        time.start();
+        for (int i = 0; i < options.senders; ++i) {
+            aborting.push_back(random.bounded(100) < options.abortPercent);
+            // Channel messages aren't streamed, they stay within the budget
+            // through the shared memory channel
+            quint32 modes = random.bounded(AllSenderModes + 1);
+            if (modes & ChannelSender)
+                modes &= ~static_cast<quint32>(SocketOnlySender);
+            const QString modesKey = QString::number(modes);
+            modeCounts.insert(modesKey, modeCounts.value(modesKey).toInt() + 1);
+            senders.push_back(spawn({QStringLiteral("sender"), key, QString::number(i),
+                                     QString::number(options.messages), QString::number(options.maxSize),
+                                     QString::number(random.generate()),
+                                     aborting.back() ? QStringLiteral("1") : QStringLiteral("0"),
+                                     QString::number(modes)}));
+        }
+        report.insert(QStringLiteral("senderModes"), modeCounts);
+        for (int i = 0; i < options.fuzzers; ++i)
+            fuzzers.push_back(spawn({QStringLiteral("fuzz"), QString::fromLocal8Bit(serverName),
+                                     QString::number(random.generate())}));
+
+        int failedSenders = 0;
+        qint64 senderPeak = -1;
+        for (size_t i = 0; i < senders.size(); ++i) {
+            QProcess *sender = senders[i];
+            const bool finished = sender->waitForFinished(PeerTimeout) && sender->exitStatus() == QProcess::NormalExit;
+            const int expectedExit = aborting[i] ? AbortExitCode : EXIT_SUCCESS;
+            if (!finished || sender->exitCode() != expectedExit)
+                ++failedSenders;
+
+            qint64 flushed = 0;
+            const QList<QByteArray> lines = sender->readAllStandardOutput().split('\n');
+            for (const QByteArray &line : lines) {
+                if (line.startsWith("flushed "))
+                    flushed = line.mid(8).toLongLong();
+                else if (line.startsWith("peak "))
+                    senderPeak = qMax(senderPeak, line.mid(5).toLongLong());
+            }
+            bounds.write(QByteArray::number(static_cast<qulonglong>(i)) + ' ' + QByteArray::number(flushed) + '\n');
+            delete sender;
+        }
+        for (QProcess *fuzzer : fuzzers)
+            finish(fuzzer);
+        const qint64 elapsed = time.nsecsElapsed();
+        bounds.flush();
+
+        finish(spawn({QStringLiteral("report"), key, bounds.fileName()}));
+        const QByteArray primaryReport = readLine(primary, "report");
+        finish(primary);
+
+        report.insert(QStringLiteral("elapsed"), static_cast<double>(elapsed));
+        report.insert(QStringLiteral("failedSenders"), failedSenders);
+        report.insert(QStringLiteral("senderPeakMemory"), static_cast<double>(senderPeak));
+        if (primaryReport.isEmpty()) {
+            report.insert(QStringLiteral("error"), QStringLiteral("The primary instance didn't survive"));
+            return report;
+        }
+
+        const QJsonObject primaryResult = QJsonDocument::fromJson(primaryReport).object();
+        report.insert(QStringLiteral("primary"), primaryResult);
+        ok = failedSenders == 0 && primaryResult.value(QStringLiteral("lost")).toDouble() == 0
+             && primaryResult.value(QStringLiteral("duplicated")).toDouble() == 0
+             && primaryResult.value(QStringLiteral("corrupted")).toDouble() == 0;
+        return report;
+    }
+
+private:
+    QProcess *spawn(const QStringList &arguments) const
+    {
+        // The peers never show a window
+        QProcessEnvironment environment = QProcessEnvironment::systemEnvironment();
+        environment.insert(QStringLiteral("QT_QPA_PLATFORM"), QStringLiteral("offscreen"));
+
+        auto *process = new QProcess();
+        process->setProcessEnvironment(environment);
+        process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+        process->start(QCoreApplication::applicationFilePath(),
+                       QStringList{QStringLiteral("--peer")} + arguments);
+        return process;
+    }
+
+    static QByteArray readLine(QProcess *process, const char *line)
+    {
+        const QByteArray prefix = QByteArray(line) + ' ';
+        while (process->canReadLine() || process->waitForReadyRead(PeerTimeout)) {
+            if (!process->canReadLine())
+                continue;
+            const QByteArray response = process->readLine().trimmed();
+            if (response.startsWith(prefix))
+                return response.mid(prefix.size());
+        }
+        return {};
+    }
+
+    static bool finish(QProcess *process)
+    {
+        const bool ok = process->waitForFinished(PeerTimeout) && process->exitStatus() == QProcess::NormalExit
+                        && process->exitCode() == EXIT_SUCCESS;
+        delete process;
+        return ok;
+    }
+
+    StressOptions options = {};
+    QString key = {};
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 4 && std::strcmp(argv[1], "--peer") == 0)
+        return runPeer(argc, argv);
+
+    QCoreApplication app(argc, argv);
+
+    StressOptions options;
+    options.seed = static_cast<quint32>(QDateTime::currentMSecsSinceEpoch());
+    QString output;
+    bool budgetSet = false;
+    const QStringList arguments = app.arguments();
+    for (int i = 1; i < arguments.size(); ++i) {
+        const QString &argument = arguments.at(i);
+        const bool hasValue = i + 1 < arguments.size();
+        if (argument == QStringLiteral("--senders") && hasValue) {
+            options.senders = qMax(1, arguments.at(++i).toInt());
+        } else if (argument == QStringLiteral("--messages") && hasValue) {
+            options.messages = qMax(1, arguments.at(++i).toInt());
+        } else if (argument == QStringLiteral("--max-size") && hasValue) {
+            options.maxSize = qMax<qint64>(PayloadHeaderSize, arguments.at(++i).toLongLong());
+        } else if (argument == QStringLiteral("--fuzzers") && hasValue) {
+            options.fuzzers = qMax(0, arguments.at(++i).toInt());
+        } else if (argument == QStringLiteral("--abort-percent") && hasValue) {
+            options.abortPercent = qBound(0, arguments.at(++i).toInt(), 100);
+        } else if (argument == QStringLiteral("--receive-budget") && hasValue) {
+            options.receiveBudget = qMax<qint64>(0, arguments.at(++i).toLongLong());
+            budgetSet = true;
+        } else if (argument == QStringLiteral("--seed") && hasValue) {
+            options.seed = arguments.at(++i).toUInt();
+        } else if (argument == QStringLiteral("--output") && hasValue) {
+            output = arguments.at(++i);
+        } else {
+            std::fprintf(stderr,
+                         "Usage: %s [--senders <n>] [--messages <n>] [--max-size <bytes>] [--fuzzers <n>]\n"
+                         "          [--abort-percent <n>] [--seed <n>] [--receive-budget <bytes>]\n"
+                         "          [--output <file>]\n",
+                         argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!budgetSet)
+        options.receiveBudget = options.maxSize / 2;
+
+    bool ok = false;
+    Driver driver(options);
+    const QByteArray report = QJsonDocument(driver.run(ok)).toJson();
+
+    if (output.isEmpty()) {
+        std::fwrite(report.constData(), 1, static_cast<size_t>(report.size()), stdout);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    QFile file(output);
+    if (!file.open(QIODevice::WriteOnly) || file.write(report) != report.size()) {
+        std::fprintf(stderr, "Unable to write %s\n", qPrintable(output));
+        return EXIT_FAILURE;
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -42,6 +42,35 @@ SingleApplication::SingleApplication(int &argc,
                                      int timeout,
                                      const QString &userData)
     : QAPPLICATION_CLASS(argc, argv), d_ptr(new SingleApplicationPrivate(this))
+{
+    initialize(allowSecondary, options, timeout, userData);
+}
+
+/**
+ * @brief Constructor using a block and server name computed beforehand, e.g.
+ * by a launcher through blockServerName(), instead of hashing the application
+ * identity.
+ * @param argc
+ * @param argv
+ * @param blockServerName The name of the block and server to use
+ * @param allowSecondary Whether to enable secondary instance support
+ * @param options Optional flags to toggle specific behaviour
+ * @param timeout Maximum time blocking functions are allowed during app load
+ */
+SingleApplication::SingleApplication(int &argc,
+                                     char *argv[],
+                                     const QString &blockServerName,
+                                     bool allowSecondary,
+                                     Options options,
+                                     int timeout)
+    : QAPPLICATION_CLASS(argc, argv), d_ptr(new SingleApplicationPrivate(this))
+{
+    Q_D(SingleApplication);
+    d->blockServerName = blockServerName;
+    initialize(allowSecondary, options, timeout, {});
+}
+
+void SingleApplication::initialize(bool allowSecondary, Options options, int timeout, const QString &userData)
 {
     Q_D(SingleApplication);
 
@@ -54,65 +83,141 @@ SingleApplication::SingleApplication(int &argc,
 
     // Store the current mode of the program
     d->options = options;
+    d->timeout = timeout;
+
+    if (options & Mode::CollectStats) {
+        d->stats = new IpcCounters;
+        d->statsClock.start();
+    }
+
+    // Every phase of the startup is accounted to one of the timings
+    QElapsedTimer startup;
+    startup.start();
+    qint64 phaseStart = 0;
+    SingleApplication::StartupTimings &timings = d->startupTimings;
+    const auto endPhase = [&startup, &phaseStart](qint64 &phase){
+        const qint64 now = startup.nsecsElapsed();
+        phase += now - phaseStart;
+        phaseStart = now;
+    };
+    const auto endStartup = [&](){
+        timings.total = startup.nsecsElapsed();
+        d->logStartupTimings();
+    };
 
     // Add any unique user data
     if (!userData.isEmpty()) {
         d->addAppData(userData);
     }
 
+    // Forwarded as the first message of this instance
+    if (d->options & Mode::ForwardArguments) {
+        d->initPayload = arguments().join(QChar(0)).toUtf8();
+        d->hasInitPayload = true;
+    }
+
     // Generating an application ID used for identifying the shared memory
     // block and QLocalServer
-    d->genBlockServerName();
-
-    // To mitigate QSharedMemory issues with large amount of processes
-    // attempting to attach at the same time
-    SingleApplicationPrivate::randomSleep();
+    if (d->blockServerName.isEmpty())
+        d->genBlockServerName();
+    endPhase(timings.blockName);
+
+    // An instance which only hands off doesn't need the shared memory block
+    // as long as a primary instance answers right away
+    if (!allowSecondary && (d->options & Mode::SocketFirst)) {
+        const bool handedOff = d->handOffToPrimary(timeout);
+        endPhase(timings.connect);
+        if (handedOff) {
+            endStartup();
+            delete d;
+            ::exit(EXIT_SUCCESS);
+        }
+    }
 
-#ifdef Q_OS_UNIX
-    // By explicitly attaching it and then deleting it we make sure that the
-    // memory is deleted even after the process has crashed on Unix.
-    d->memory = new QSharedMemory(d->blockServerName);
-    d->memory->attach();
-    delete d->memory;
-#endif
-    // Guarantee thread safe behaviour with a shared memory block.
+    // Guarantee thread safe behaviour with a shared memory block. A block left
+    // by a crashed process on Unix is reused, the PIDs recorded in it tell
+    // whether its owners are still alive.
     d->memory = new QSharedMemory(d->blockServerName);
 
-    // Create a shared memory block
-    if (d->memory->create(sizeof(InstancesInfo))) {
-        // Initialize the shared memory block
-        if (!d->memory->lock()) {
-            qCritical() << "SingleApplication: Unable to lock memory block after create.";
+    // Create or attach to the shared memory block. Racing instances only back
+    // off after an actual collision.
+    int attempt = 0;
+    while (true) {
+        if (d->memory->create(d->blockSize())) {
+            endPhase(timings.blockAcquire);
+            // Initialize the shared memory block
+            if (!d->lockMemory()) {
+                qCritical() << "SingleApplication: Unable to lock memory block after create.";
+                abortSafely();
+            }
+            endPhase(timings.lockWait);
+            d->initializeMemoryBlock();
+            break;
+        }
+
+        if (d->memory->error() != QSharedMemory::AlreadyExists) {
+            qCritical() << "SingleApplication: Unable to create block.";
             abortSafely();
         }
-        d->initializeMemoryBlock();
-    } else {
-        if (d->memory->error() == QSharedMemory::AlreadyExists) {
-            // Attempt to attach to the memory segment
-            if (!d->memory->attach()) {
-                qCritical() << "SingleApplication: Unable to attach to shared memory block.";
-                abortSafely();
+
+        // Attempt to attach to the memory segment
+        if (d->memory->attach()) {
+            endPhase(timings.blockAcquire);
+#ifdef Q_OS_UNIX
+            // A crashed instance of a version with a smaller block left it
+            // behind. Detaching it as its last user deletes it.
+            if (d->memory->size() < d->blockSize()) {
+                d->memory->detach();
+                endPhase(timings.staleBlockCleanup);
+                if (attempt >= SingleApplicationPrivate::MaximumCreateAttempts) {
+                    qCritical() << "SingleApplication: Shared memory block is in use by an incompatible instance.";
+                    abortSafely();
+                }
+                d->backoff(attempt);
+                endPhase(timings.backoff);
+                continue;
             }
-            if (!d->memory->lock()) {
+#endif
+            if (!d->lockMemory()) {
                 qCritical() << "SingleApplication: Unable to lock memory block after attach.";
                 abortSafely();
             }
-        } else {
-            qCritical() << "SingleApplication: Unable to create block.";
+            endPhase(timings.lockWait);
+            if (!d->isBlockLayoutCompatible()) {
+                qCritical() << "SingleApplication: Shared memory block is in use by an incompatible instance.";
+                abortSafely();
+            }
+            break;
+        }
+        endPhase(timings.blockAcquire);
+
+        // The block vanished between create() and attach() because its last
+        // owner just exited, retry unless that keeps happening.
+        if (d->memory->error() != QSharedMemory::NotFound || attempt >= SingleApplicationPrivate::MaximumCreateAttempts) {
+            qCritical() << "SingleApplication: Unable to attach to shared memory block.";
             abortSafely();
         }
+        d->backoff(attempt);
+        endPhase(timings.backoff);
     }
 
-    auto *inst = static_cast<InstancesInfo *>(d->memory->data());
     QElapsedTimer time;
     time.start();
+    attempt = 0;
 
     // Make sure the shared memory block is initialised and in consistent state
     while (true) {
         // If the shared memory block's checksum is valid continue
-        if (d->blockChecksum() == inst->checksum)
+        if (d->isBlockConsistent())
             break;
 
+        // Repair the block right away if the instance which last wrote it is
+        // gone, a block which hasn't been initialised yet is waited for
+        if (d->recoverMemoryBlock()) {
+            endPhase(timings.consistencyWait);
+            continue;
+        }
+
         // If more than 5s have elapsed, assume the primary instance crashed and
         // assume it's position
         if (time.elapsed() > 5000) {
@@ -121,26 +226,32 @@ SingleApplication::SingleApplication(int &argc,
             d->initializeMemoryBlock();
         }
 
-        // Otherwise wait for a random period and try again. The random sleep here
-        // limits the probability of a collision between two racing apps and
-        // allows the app to initialise faster
-        if (!d->memory->unlock()) {
+        // Otherwise back off for a growing, random period and try again. The
+        // jitter limits the probability of a collision between two racing apps
+        // and allows the app to initialise faster
+        if (!d->unlockMemory()) {
             qDebug() << "SingleApplication: Unable to unlock memory for random wait.";
             qDebug() << d->memory->errorString();
         }
-        SingleApplicationPrivate::randomSleep();
-        if (!d->memory->lock()) {
+        endPhase(timings.consistencyWait);
+        d->backoff(attempt);
+        endPhase(timings.backoff);
+        if (!d->lockMemory()) {
             qCritical() << "SingleApplication: Unable to lock memory after random wait.";
             abortSafely();
         }
+        endPhase(timings.lockWait);
     }
+    endPhase(timings.consistencyWait);
 
-    if (inst->primary == false) {
+    if (d->claimPrimary()) {
         d->startPrimary();
-        if (!d->memory->unlock()) {
+        if (!d->unlockMemory()) {
             qDebug() << "SingleApplication: Unable to unlock memory after primary start.";
             qDebug() << d->memory->errorString();
         }
+        endPhase(timings.serverStart);
+        endStartup();
         return;
     }
 
@@ -151,19 +262,40 @@ SingleApplication::SingleApplication(int &argc,
             d->connectToPrimary(timeout,
                                 SingleApplicationPrivate::ConnectionType::SecondaryInstance);
         }
-        if (!d->memory->unlock()) {
+        if (!d->unlockMemory()) {
             qDebug() << "SingleApplication: Unable to unlock memory after secondary start.";
             qDebug() << d->memory->errorString();
         }
+        endPhase(timings.connect);
+        endStartup();
         return;
     }
 
-    if (!d->memory->unlock()) {
+    if (!d->unlockMemory()) {
         qDebug() << "SingleApplication: Unable to unlock memory at end of execution.";
         qDebug() << d->memory->errorString();
     }
 
-    d->connectToPrimary(timeout, SingleApplicationPrivate::ConnectionType::NewInstance);
+    const bool connected = d->connectToPrimary(timeout, SingleApplicationPrivate::ConnectionType::NewInstance);
+    endPhase(timings.connect);
+    if (!connected && d->lockMemory()) {
+        // The registered primary instance may be gone with its PID reused
+        if (d->releaseStalePrimary(timeout) && d->claimPrimary()) {
+            d->startPrimary();
+            if (!d->unlockMemory()) {
+                qDebug() << "SingleApplication: Unable to unlock memory after primary start.";
+                qDebug() << d->memory->errorString();
+            }
+            endPhase(timings.serverStart);
+            endStartup();
+            return;
+        }
+        if (!d->unlockMemory()) {
+            qDebug() << "SingleApplication: Unable to unlock memory after primary check.";
+            qDebug() << d->memory->errorString();
+        }
+    }
+    endStartup();
 
     delete d;
 
@@ -230,13 +362,25 @@ QString SingleApplication::primaryUser() const
     return d->primaryUser();
 }
 
+/**
+ * Returns the instances registered in the instance table of the shared memory
+ * block, the primary instance included.
+ * @return Returns the live instances, empty without Mode::InstanceTable.
+ */
+QList<SingleApplication::RunningInstance> SingleApplication::runningInstances() const
+{
+    Q_D(const SingleApplication);
+    return d->runningInstances();
+}
+
 /**
  * Returns the username the current instance is running as.
  * @return Returns the username the current instance is running as.
  */
 QString SingleApplication::currentUser() const
 {
-    return SingleApplicationPrivate::getUsername();
+    Q_D(const SingleApplication);
+    return d->username();
 }
 
 /**
@@ -253,11 +397,126 @@ bool SingleApplication::sendMessage(const QByteArray &message, int timeout)
     if (isPrimary())
         return false;
 
-    // Make sure the socket is connected
-    if (!d->connectToPrimary(timeout, SingleApplicationPrivate::ConnectionType::Reconnect))
+    return d->sendMessage(message, timeout);
+}
+
+/**
+ * Sends a message to the Primary Instance on a named channel.
+ * @param channel The name of the channel.
+ * @param message The message to send.
+ * @param timeout the maximum timeout in milliseconds for blocking functions.
+ * @return true if the message was sent successfuly, false otherwise.
+ */
+bool SingleApplication::sendChannelMessage(const QString &channel, const QByteArray &message, int timeout)
+{
+    Q_D(SingleApplication);
+
+    // Nobody to connect to
+    if (isPrimary())
+        return false;
+
+    return d->sendChannelMessage(channel, message, timeout);
+}
+
+/**
+ * Sends several messages to the Primary Instance in a single frame.
+ * @param messages The messages to send.
+ * @param timeout the maximum timeout in milliseconds for blocking functions.
+ * @return true if the messages were sent successfuly, false otherwise.
+ */
+bool SingleApplication::sendMessages(const QList<QByteArray> &messages, int timeout)
+{
+    Q_D(SingleApplication);
+
+    // Nobody to connect to
+    if (isPrimary())
+        return false;
+
+    return d->sendMessages(messages, timeout);
+}
+
+/**
+ * Sends a message to a connected Secondary Instance without blocking.
+ * @param instanceId The id of the instance.
+ * @param message The message to send.
+ * @return true if the message has been queued, false otherwise.
+ */
+bool SingleApplication::sendMessageToInstance(quint32 instanceId, const QByteArray &message)
+{
+    Q_D(SingleApplication);
+
+    // Only the primary instance knows the others
+    if (isSecondary())
         return false;
 
-    return d->writeConfirmedMessage(timeout, message);
+    return d->sendMessageToInstance(instanceId, message);
+}
+
+/**
+ * Sends a message to every connected Secondary Instance without blocking.
+ * @param message The message to send.
+ * @return the number of instances the message has been queued for.
+ */
+int SingleApplication::broadcastMessage(const QByteArray &message)
+{
+    Q_D(SingleApplication);
+
+    // Only the primary instance knows the others
+    if (isSecondary())
+        return 0;
+
+    return d->broadcastMessage(message);
+}
+
+/**
+ * Queues a message for the Primary Instance and returns immediately.
+ * @param message The message to send.
+ * @param timeout the maximum time in milliseconds until the message is
+ * delivered.
+ * @return the identifier reported by messageDelivered(), 0 on failure.
+ */
+quint64 SingleApplication::sendMessageAsync(const QByteArray &message, int timeout)
+{
+    Q_D(SingleApplication);
+
+    // Nobody to connect to
+    if (isPrimary())
+        return 0;
+
+    return d->sendMessageAsync(message, timeout);
+}
+
+/**
+ * Waits for the Primary Instance to acknowledge all pipelined messages.
+ * @param timeout the maximum timeout in milliseconds for blocking functions.
+ * @return true if every message has been acknowledged, false otherwise.
+ */
+bool SingleApplication::flushMessages(int timeout)
+{
+    Q_D(SingleApplication);
+
+    // Nothing is ever sent from the primary instance
+    if (isPrimary())
+        return true;
+
+    return d->flushMessages(timeout);
+}
+
+/**
+ * Sets the number of connections kept open to the Primary Instance. The
+ * additional connections are established in the background, messages from
+ * different threads are spread over them.
+ * @param size the number of connections, at least 1.
+ */
+void SingleApplication::setConnectionPoolSize(int size)
+{
+    Q_D(SingleApplication);
+
+    // Nobody to connect to
+    if (isPrimary())
+        return;
+
+    d->setConnectionPoolSize(size);
 }
 
 /**
@@ -273,6 +532,137 @@ void SingleApplication::abortSafely()
     ::exit(EXIT_FAILURE);
 }
 
+/**
+ * Sets the size from which messages are written into a shared memory channel
+ * and only a small descriptor is sent through the socket.
+ * @param size the minimum message size in bytes, 0 disables the channel.
+ */
+void SingleApplication::setSharedMemoryThreshold(qint64 size)
+{
+    Q_D(SingleApplication);
+    d->sharedMemoryThreshold = qMax<qint64>(0, size);
+}
+
+/**
+ * Sets the size from which messages are compressed before they are passed to
+ * the primary instance.
+ * @param size the minimum message size in bytes, 0 disables compression.
+ */
+void SingleApplication::setCompressionThreshold(qint64 size)
+{
+    Q_D(SingleApplication);
+    d->compressionThreshold = qMax<qint64>(0, size);
+}
+
+/**
+ * Sets the size from which received messages are streamed to the
+ * messageChunk() signal instead of being buffered in full.
+ * @param size the minimum message size in bytes, 0 disables streaming.
+ */
+void SingleApplication::setStreamingThreshold(qint64 size)
+{
+    Q_D(SingleApplication);
+    d->streamingThreshold = qMax<qint64>(0, size);
+}
+
+/**
+ * Collects received messages for up to msecs milliseconds or until there are
+ * maxMessages of them and emits them with receivedMessageBatch().
+ * @param msecs the window, 0 ends it when control returns to the event loop.
+ * @param maxMessages the maximum size of a batch, 0 is unlimited.
+ */
+void SingleApplication::setCoalescingWindow(int msecs, int maxMessages)
+{
+    Q_D(SingleApplication);
+    d->setCoalescingWindow(msecs, maxMessages);
+}
+
+/**
+ * Limits the bytes the primary buffers for incomplete messages.
+ * @param connectionBytes the budget of each connection, 0 is unlimited.
+ * @param totalBytes the budget of all connections, 0 is unlimited.
+ */
+void SingleApplication::setReceiveBudget(qint64 connectionBytes, qint64 totalBytes)
+{
+    Q_D(SingleApplication);
+    d->receiveBudget = qMax<qint64>(0, connectionBytes);
+    d->totalReceiveBudget = qMax<qint64>(0, totalBytes);
+}
+
+/**
+ * Returns why the last message could not be sent.
+ * @return Returns the error of the last sendMessage() or sendMessages() call.
+ */
+SingleApplication::SendError SingleApplication::lastSendError() const
+{
+    Q_D(const SingleApplication);
+    return static_cast<SendError>(d->lastSendError.load(std::memory_order_relaxed));
+}
+
+/**
+ * Sets the limits of the randomised exponential backoff used when racing
+ * instances collide. The n-th consecutive delay is picked from the upper half
+ * of min(initialDelay * 2^n, maximumDelay).
+ * @param initialDelay the upper bound of the first delay in milliseconds.
+ * @param maximumDelay the upper bound of any delay in milliseconds.
+ */
+void SingleApplication::setBackoffLimits(int initialDelay, int maximumDelay)
+{
+    SingleApplicationPrivate::setBackoffLimits(initialDelay, maximumDelay);
+}
+
+/**
+ * Returns the total time this instance was blocked backing off after
+ * collisions with other instances.
+ * @return Returns the time spent backing off in milliseconds.
+ */
+qint64 SingleApplication::backoffTime() const
+{
+    Q_D(const SingleApplication);
+    return d->backoffTime.load(std::memory_order_relaxed);
+}
+
+/**
+ * Returns the name of the shared memory block and local server, which can be
+ * passed to the constructor of other instances.
+ * @return Returns the block and server name.
+ */
+QString SingleApplication::blockServerName() const
+{
+    Q_D(const SingleApplication);
+    return d->blockServerName;
+}
+
+/**
+ * Returns the time spent in each phase of the constructor.
+ * @return Returns the startup timings in nanoseconds.
+ */
+SingleApplication::StartupTimings SingleApplication::startupTimings() const
+{
+    Q_D(const SingleApplication);
+    return d->startupTimings;
+}
+
+/**
+ * Returns the counters of the IPC channel.
+ * @return Returns the counters collected with Mode::CollectStats.
+ */
+SingleApplication::IpcStats SingleApplication::ipcStats() const
+{
+    Q_D(const SingleApplication);
+    return d->ipcStats();
+}
+
+/**
+ * Emits ipcStatsUpdated() periodically.
+ * @param msecs the interval in milliseconds, 0 stops the updates.
+ */
+void SingleApplication::setIpcStatsInterval(int msecs)
+{
+    Q_D(SingleApplication);
+    d->setIpcStatsInterval(msecs);
+}
+
 QStringList SingleApplication::userData() const
 {
     Q_D(const SingleApplication);
@@ -28,6 +28,8 @@
 
 #include "singleapplication_global.h"
 #include QT_STRINGIFY(QAPPLICATION_CLASS)
+#include <QHash>
+#include <QList>
 
 QT_FORWARD_DECLARE_CLASS(SingleApplicationPrivate)
 
@@ -58,11 +60,83 @@ public:
         System = 1 << 1,
         SecondaryNotification = 1 << 2,
         ExcludeAppVersion = 1 << 3,
-        ExcludeAppPath = 1 << 4
+        ExcludeAppPath = 1 << 4,
+        ExtendedProtocol = 1 << 5,
+        LockFreeRegistry = 1 << 6,
+        MessageViews = 1 << 7,
+        IpcThread = 1 << 8,
+        CacheBlockName = 1 << 9,
+        SocketFirst = 1 << 10,
+        ForwardArguments = 1 << 11,
+        CollectStats = 1 << 12,
+        Crc32cChecksums = 1 << 13,
+        InstanceTable = 1 << 14
     };
     Q_ENUM(Mode)
     Q_DECLARE_FLAGS(Options, Mode)
 
+    /**
+     * @brief Why the last call of sendMessage() or sendMessages() failed
+     */
+    enum class SendError {
+        NoError,
+        TimeoutError,    // The primary didn't accept the message in time
+        WouldBlockError, // The budget of the primary stayed exhausted
+        OverBudgetError  // The message exceeds the budget of the primary
+    };
+    Q_ENUM(SendError)
+
+    /**
+     * @brief Time spent in the phases of the SingleApplication constructor,
+     * measured with a monotonic clock in nanoseconds.
+     */
+    struct StartupTimings {
+        qint64 blockName = 0;         // Hashing the block and server name
+        qint64 staleBlockCleanup = 0; // Releasing a block left by a crash (Unix)
+        qint64 blockAcquire = 0;      // Creating or attaching the shared block
+        qint64 lockWait = 0;          // Waiting for the lock of the block
+        qint64 consistencyWait = 0;   // Waiting for a consistent block
+        qint64 backoff = 0;           // Backing off after collisions
+        qint64 serverStart = 0;       // Starting the local server (primary)
+        qint64 connect = 0;           // Connecting to the primary (secondary)
+        qint64 total = 0;
+    };
+
+    /**
+     * @brief Counters of the IPC channel, collected with Mode::CollectStats.
+     * Bucket 0 of a latency histogram counts latencies below a microsecond,
+     * bucket n those from 2^(n-1) to 2^n microseconds and the last bucket
+     * everything above as well.
+     */
+    struct IpcStats {
+        struct Instance {
+            quint64 messagesReceived = 0;
+            quint64 bytesReceived = 0;
+        };
+        static constexpr int HistogramBuckets = 24;
+
+        quint64 messagesSent = 0;         // To the primary (secondary)
+        quint64 bytesSent = 0;
+        quint64 messagesReceived = 0;     // From all secondaries (primary)
+        quint64 bytesReceived = 0;
+        quint64 connectRetries = 0;       // Failed attempts to reach the primary
+        int connections = 0;              // Open connections (primary)
+        QHash<quint32, Instance> instances = {}; // Received per instance id
+        QList<quint64> ackLatency = {};   // From writing a message to its ack
+        QList<quint64> frameLatency = {}; // From a frame header to its last byte
+    };
+
+    /**
+     * @brief An instance registered in the table of Mode::InstanceTable
+     */
+    struct RunningInstance {
+        quint32 instanceId = 0;
+        qint64 pid = 0;
+        qint64 startTime = 0; // Milliseconds since the epoch
+        qint64 heartbeat = 0; // Last time it has been alive, same clock
+        bool primary = false;
+    };
+
     /**
      * @brief Intitializes a SingleApplication instance with argc command line
      * arguments in argv
@@ -77,6 +151,46 @@ public:
      * recognizes
      * @note Mode::SecondaryNotification only works if set on both the primary
      * instance and the secondary instance.
+     * @note Mode::ExtendedProtocol makes the secondary instance pipeline its
+     * messages and requires a primary instance built with the same version of
+     * SingleApplication.
+     * @note Mode::LockFreeRegistry replaces the lock of the shared memory block
+     * with atomic operations and has to be set on every instance.
+     * @note With Mode::MessageViews the primary instance reuses a buffer per
+     * connection and receivedMessage() only passes a view of it. The view is
+     * valid until the slot returns, so connect with Qt::DirectConnection.
+     * Copies of the QByteArray share the view, only an explicit deep copy such
+     * as QByteArray(message.constData(), message.size()) keeps the data.
+     * @note Mode::IpcThread makes sendMessage(), sendMessageAsync() and
+     * flushMessages() callable from any thread. The connections to the primary
+     * instance are then driven by a dedicated thread and messageDelivered() is
+     * emitted from it. Without it these functions may only be called from the
+     * thread of the application object. On the primary instance the server
+     * runs in that thread as well, received messages are passed to the main
+     * thread in batches and are always copies, even with Mode::MessageViews.
+     * @note Mode::CacheBlockName keeps the block name and the username in the
+     * runtime location, keyed by the user and the modification time of the
+     * binary, and skips hashing and the user lookup on the next launches.
+     * @note With Mode::SocketFirst an instance which doesn't allow secondary
+     * instances connects to the primary instance before touching the shared
+     * memory block and exits right away if it answers.
+     * @note With Mode::ForwardArguments a secondary instance sends its
+     * arguments(), encoded as UTF-8 and separated by '\0', to the primary
+     * instance on its first connection, also one made by sendMessage().
+     * With Mode::ExtendedProtocol they are part of the handshake and
+     * receivedMessage() follows instanceStarted() directly.
+     * @note Mode::CollectStats maintains the counters returned by ipcStats().
+     * @note Mode::InstanceTable implies Mode::LockFreeRegistry and records
+     * every running instance in the shared memory block, which makes
+     * runningInstances() available. It has to be set on every instance.
+     * @note Mode::Crc32cChecksums protects the shared memory block and, once
+     * the primary instance supports it, every message with a CRC32C, computed
+     * in hardware where the CPU supports it. All instances of an application
+     * must use the same setting.
+     * @note The shared memory blocks of Mode::LockFreeRegistry,
+     * Mode::InstanceTable and Mode::Crc32cChecksums record their layout. An
+     * instance finding a block of another layout aborts instead of misreading
+     * it.
      * @note The timeout is just a hint for the maximum time of blocking
      * operations. It does not guarantee that the SingleApplication
      * initialisation will be completed in given time, though is a good hint.
@@ -89,6 +203,25 @@ public:
                                Options options = Mode::User,
                                int timeout = 1000,
                                const QString &userData = {});
+
+    /**
+     * @brief Intitializes a SingleApplication instance with a block and server
+     * name computed beforehand, which skips hashing the application identity
+     * @arg {const QString &} blockServerName - The name returned by
+     * blockServerName() of an instance of the same application
+     * @note The other arguments are the same as in the constructor above,
+     * users of the default constructor will not share the block unless they
+     * compute the same name.
+     */
+    explicit SingleApplication(int &argc,
+                               char *argv[],
+                               const QString &blockServerName,
+                               bool allowSecondary = false,
+                               Options options = Mode::User,
+                               int timeout = 1000);
+    // A string literal would silently pick the allowSecondary overload
+    SingleApplication(int &argc, char *argv[], const char *blockServerName, bool allowSecondary = false,
+                      Options options = Mode::User, int timeout = 1000) = delete;
     ~SingleApplication() override;
 
     /**
@@ -121,12 +254,28 @@ public:
      */
     QString primaryUser() const;
 
+    /**
+     * @brief Returns the instances recorded with Mode::InstanceTable whose
+     * process is still alive, without connecting to any of them
+     * @returns {QList<RunningInstance>}
+     * @note The heartbeat of an instance is refreshed by its event loop
+     * every second, an instance whose heartbeat lags has stopped responding.
+     * Without Mode::InstanceTable the list is empty.
+     */
+    QList<RunningInstance> runningInstances() const;
+
     /**
      * @brief Returns the username of the current user
      * @returns {QString}
      */
     QString currentUser() const;
 
+    /**
+     * @brief Returns the name of the shared memory block and local server
+     * @returns {QString}
+     */
+    QString blockServerName() const;
+
     /**
      * @brief Sends a message to the primary instance. Returns true on success.
      * @param {int} timeout - Timeout for connecting
@@ -136,6 +285,211 @@ public:
      */
     bool sendMessage(const QByteArray &message, int timeout = 100);
 
+    /**
+     * @brief Sends a message to the primary instance on a named channel, which
+     * emits receivedChannelMessage() for it. Returns true on success.
+     * @param {QString} channel - The name of the channel, an empty name is
+     * the channel of sendMessage()
+     * @param {int} timeout - Timeout for connecting
+     * @returns {bool}
+     * @note Every channel has a connection of its own, so its messages are
+     * never stuck behind large messages of another channel. The messages of
+     * one channel keep their order. Requires Mode::ExtendedProtocol and a
+     * primary instance which supports channels.
+     */
+    bool sendChannelMessage(const QString &channel, const QByteArray &message, int timeout = 100);
+
+    /**
+     * @brief Sends several messages to the primary instance at once. Returns
+     * true on success.
+     * @param {int} timeout - Timeout for the whole batch
+     * @returns {bool}
+     * @note With Mode::ExtendedProtocol the batch is written as a single frame
+     * and acknowledged as a unit, the primary instance emits
+     * receivedMessages() once if it is connected and receivedMessage() for
+     * every message otherwise. Without it the messages are sent one by one.
+     */
+    bool sendMessages(const QList<QByteArray> &messages, int timeout = 100);
+
+    /**
+     * @brief Sends a message from the primary instance to a connected
+     * secondary instance, which emits receivedMessage() with instance id 0.
+     * Returns true if the message has been queued.
+     * @param {quint32} instanceId - The id reported by receivedMessage()
+     * @returns {bool}
+     * @note The secondary instance has to use Mode::ExtendedProtocol and be
+     * connected, e.g. through Mode::SecondaryNotification or a message it
+     * sent. The write doesn't block and is coalesced with other messages to
+     * the same instance.
+     * @note With Mode::IpcThread the secondary instance emits receivedMessage()
+     * from its IPC thread, so slots connected with Qt::DirectConnection run
+     * in that thread.
+     */
+    bool sendMessageToInstance(quint32 instanceId, const QByteArray &message);
+
+    /**
+     * @brief Sends a message from the primary instance to every connected
+     * secondary instance. Returns the number of instances it was queued for.
+     * @returns {int}
+     * @see sendMessageToInstance()
+     */
+    int broadcastMessage(const QByteArray &message);
+
+    /**
+     * @brief Waits until the primary instance has acknowledged every message
+     * sent so far. Returns true on success.
+     * @param {int} timeout - Timeout for waiting
+     * @returns {bool}
+     * @note With Mode::ExtendedProtocol sendMessage() returns as soon as the
+     * message has been written, call flushMessages() to make sure it arrived.
+     * Messages queued with sendMessageAsync() are waited for as well.
+     */
+    bool flushMessages(int timeout = 100);
+
+    /**
+     * @brief Queues a message for the primary instance without blocking.
+     * Returns an identifier which is reported by messageDelivered() once the
+     * primary instance acknowledged the message or the timeout expired.
+     * @param {int} timeout - Timeout for delivering the message
+     * @returns {quint64}
+     * @note sendMessageAsync() will return 0 if invoked from the primary
+     * instance.
+     */
+    quint64 sendMessageAsync(const QByteArray &message, int timeout = 100);
+
+    /**
+     * @brief Sets the size from which messages are passed to the primary
+     * instance through a shared memory channel instead of the socket.
+     * @param {qint64} size - Minimum message size in bytes, 0 disables it
+     * @note Requires Mode::ExtendedProtocol, smaller messages and messages
+     * that do not fit into shared memory still go through the socket.
+     * @note The channel is only accessible to the user who created it, so it
+     * is only used with Mode::User. Without it the primary instance may run
+     * as another user and every message goes through the socket.
+     */
+    void setSharedMemoryThreshold(qint64 size);
+
+    /**
+     * @brief Sets the size from which messages are compressed with qCompress()
+     * before they are passed to the primary instance.
+     * @param {qint64} size - Minimum message size in bytes, 0 disables it
+     * @note Requires Mode::ExtendedProtocol. Messages are sent uncompressed
+     * if compressing them doesn't make them smaller, receivedMessage() always
+     * carries the original message.
+     * @note Only messages up to the receive budget of the primary instance, or
+     * 1 MiB without a budget, are compressed. The primary instance closes the
+     * connection of a compressed message which would inflate beyond that.
+     */
+    void setCompressionThreshold(qint64 size);
+
+    /**
+     * @brief Sets the size from which the primary instance passes received
+     * messages on while they arrive instead of buffering them in full.
+     * Such a message is reported by messageStarted() with its total length,
+     * followed by messageChunk() for every piece of it and messageFinished().
+     * @param {qint64} size - Minimum message size in bytes, 0 disables it
+     * @note A chunk is a view of a buffer of the connection which is valid
+     * until the slot returns, so connect with Qt::DirectConnection. Copies of
+     * the QByteArray share the view, only an explicit deep copy such as
+     * QByteArray(chunk.constData(), chunk.size()) keeps the data. With
+     * Mode::IpcThread chunks are copies.
+     * @note Batches, compressed messages and messages from the shared memory
+     * channel are always delivered by receivedMessage().
+     */
+    void setStreamingThreshold(qint64 size);
+
+    /**
+     * @brief Makes the primary instance collect the messages of all secondary
+     * instances and emit them together through receivedMessageBatch().
+     * @param {int} msecs - How long a message may wait for others
+     * @param {int} maxMessages - Size at which a batch is emitted right away,
+     * 0 is unlimited
+     * @note With msecs 0 a batch holds what arrived until control returns to
+     * the event loop. Both 0 disables coalescing.
+     * @note Only takes effect while receivedMessageBatch() is connected, the
+     * messages are always copies and are emitted in order of arrival.
+     * Channel and streamed messages aren't coalesced.
+     */
+    void setCoalescingWindow(int msecs, int maxMessages = 0);
+
+    /**
+     * @brief Limits the bytes the primary instance buffers for messages which
+     * haven't been received in full yet.
+     * @param {qint64} connectionBytes - Per connection, 0 is unlimited
+     * @param {qint64} totalBytes - Of all connections together, 0 is unlimited
+     * @note Secondary instances with Mode::ExtendedProtocol are told the
+     * budget of their connection and never have more bytes unacknowledged.
+     * They wait for acks instead and fail with SendError::WouldBlockError when
+     * that takes longer than the timeout, or with SendError::OverBudgetError
+     * for messages which can never fit. Messages through the shared memory
+     * channel only take the size of their descriptor, messages the primary
+     * instance streams may be larger than the budget. The budget and the
+     * streaming threshold are announced when a secondary instance connects,
+     * so set them before. Connections of older or legacy secondaries sending
+     * a larger message are closed.
+     * @note Once the total budget is exhausted the primary instance stops
+     * reading from the connections until messages in progress completed.
+     * A message is admitted while the total isn't exhausted yet, so up to one
+     * message per connection may be buffered beyond it.
+     */
+    void setReceiveBudget(qint64 connectionBytes, qint64 totalBytes = 0);
+
+    /**
+     * @brief Returns why the last sendMessage() or sendMessages() call failed.
+     * @returns {SendError}
+     * @note With Mode::IpcThread the calls of all threads share it.
+     */
+    SendError lastSendError() const;
+
+    /**
+     * @brief Keeps several connections to the primary instance open. They are
+     * established in the background and reused by every following message.
+     * @param {int} size - Number of connections, at least 1
+     * @note The messages of a thread always go through the same connection
+     * and retain their order. A thread keeps its connection when the size
+     * changes, the threads of a removed connection move to another one once
+     * their messages have been flushed. With Mode::ExtendedProtocol a dropped connection
+     * resumes its session instead of repeating the full handshake.
+     */
+    void setConnectionPoolSize(int size);
+
+    /**
+     * @brief Sets the limits of the randomised exponential backoff applied
+     * when racing instances collide during startup or while connecting.
+     * @param {int} initialDelay - Upper bound of the first delay in milliseconds
+     * @param {int} maximumDelay - Upper bound of any delay in milliseconds
+     * @note Has to be called before the SingleApplication constructor to apply
+     * to the startup.
+     */
+    static void setBackoffLimits(int initialDelay = 2, int maximumDelay = 64);
+
+    /**
+     * @brief Returns the time spent backing off after collisions
+     * @returns {qint64} - The time in milliseconds
+     */
+    qint64 backoffTime() const;
+
+    /**
+     * @brief Returns where the time of the SingleApplication constructor went
+     * @returns {StartupTimings}
+     * @note The same breakdown is logged to the "singleapplication.startup"
+     * logging category at debug level, which is disabled by default.
+     */
+    StartupTimings startupTimings() const;
+
+    /**
+     * @brief Returns the counters of the IPC channel of this instance.
+     * @returns {IpcStats}
+     * @note Everything is 0 unless Mode::CollectStats is set.
+     */
+    IpcStats ipcStats() const;
+
+    /**
+     * @brief Emits ipcStatsUpdated() every msecs milliseconds.
+     * @param {int} msecs - The interval, 0 stops the updates
+     */
+    void setIpcStatsInterval(int msecs);
+
     /**
      * @brief Get the set user data.
      * @returns {QStringList}
@@ -145,9 +499,18 @@ public:
 Q_SIGNALS:
     void instanceStarted();
     void receivedMessage(quint32 instanceId, QByteArray message);
+    void receivedMessages(quint32 instanceId, QList<QByteArray> messages);
+    void receivedMessageBatch(QList<QPair<quint32, QByteArray>> messages);
+    void receivedChannelMessage(quint32 instanceId, QString channel, QByteArray message);
+    void messageDelivered(quint64 messageId, bool ok);
+    void messageStarted(quint32 instanceId, quint64 streamId, qint64 length);
+    void messageChunk(quint64 streamId, const QByteArray &chunk);
+    void messageFinished(quint64 streamId, bool complete);
+    void ipcStatsUpdated(const SingleApplication::IpcStats &stats);
 
 private:
     SingleApplicationPrivate *d_ptr = nullptr;
+    void initialize(bool allowSecondary, Options options, int timeout, const QString &userData);
     void abortSafely();
 };
 
@@ -0,0 +1,164 @@
+// The MIT License (MIT)
+//
+// Copyright (C) Itay Grudev 2015 - 2021
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+//
+//  W A R N I N G !!!
+//  -----------------
+//
+// This file is not part of the SingleApplication API. It is used purely as an
+// implementation detail. This header file may change from version to
+// version without notice, or may even be removed.
+//
+
+#include "singleapplication_p.h"
+#include <QtEndian>
+
+// The instructions are selected at runtime, the rest of the library doesn't
+// depend on the instruction set the compiler targets.
+#if defined(Q_PROCESSOR_X86) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define SINGLEAPPLICATION_CRC32C_X86
+#define SINGLEAPPLICATION_TARGET_SSE42 __attribute__((target("sse4.2")))
+#elif defined(Q_PROCESSOR_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define SINGLEAPPLICATION_CRC32C_X86
+#define SINGLEAPPLICATION_TARGET_SSE42
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define SINGLEAPPLICATION_CRC32C_ARM
+#endif
+
+namespace {
+
+// Reflected Castagnoli polynomial
+constexpr quint32 Crc32cPolynomial = 0x82F63B78;
+
+struct Crc32cTables
+{
+    quint32 table[8][256];
+
+    Crc32cTables()
+    {
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ (Crc32cPolynomial & (0u - (crc & 1u)));
+            table[0][i] = crc;
+        }
+        for (quint32 i = 0; i < 256; ++i) {
+            for (int slice = 1; slice < 8; ++slice)
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+        }
+    }
+};
+
+// Slicing-by-8, consuming eight bytes per step
+quint32 crc32cSoftware(quint32 crc, const uchar *data, size_t length)
+{
+    static const Crc32cTables tables;
+    const auto &t = tables.table;
+
+    while (length >= 8) {
+        const quint32 low = qFromLittleEndian<quint32>(data) ^ crc;
+        const quint32 high = qFromLittleEndian<quint32>(data + 4);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+            ^ t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^ t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+
+    return crc;
+}
+
+#if defined(SINGLEAPPLICATION_CRC32C_X86)
+SINGLEAPPLICATION_TARGET_SSE42 quint32 crc32cHardware(quint32 crc, const uchar *data, size_t length)
+{
+#if defined(Q_PROCESSOR_X86_64)
+    quint64 crc64 = crc;
+    while (length >= 8) {
+        crc64 = _mm_crc32_u64(crc64, qFromLittleEndian<quint64>(data));
+        data += 8;
+        length -= 8;
+    }
+    crc = static_cast<quint32>(crc64);
+#endif
+    while (length >= 4) {
+        crc = _mm_crc32_u32(crc, qFromLittleEndian<quint32>(data));
+        data += 4;
+        length -= 4;
+    }
+    while (length-- > 0)
+        crc = _mm_crc32_u8(crc, *data++);
+
+    return crc;
+}
+
+bool hasHardwareCrc32c()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4] = {};
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(SINGLEAPPLICATION_CRC32C_ARM)
+quint32 crc32cHardware(quint32 crc, const uchar *data, size_t length)
+{
+    while (length >= 8) {
+        crc = __crc32cd(crc, qFromLittleEndian<quint64>(data));
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+        crc = __crc32cb(crc, *data++);
+
+    return crc;
+}
+
+bool hasHardwareCrc32c()
+{
+    // The compiler only defines __ARM_FEATURE_CRC32 for targets having it
+    return true;
+}
+#endif
+
+} // namespace
+
+quint32 SingleApplicationPrivate::crc32c(const void *data, size_t length, quint32 crc)
+{
+    // Passing the previous result continues the checksum
+    crc = ~crc;
+    const auto *bytes = static_cast<const uchar *>(data);
+
+#if defined(SINGLEAPPLICATION_CRC32C_X86) || defined(SINGLEAPPLICATION_CRC32C_ARM)
+    static const bool hardware = hasHardwareCrc32c();
+    if (hardware)
+        return ~crc32cHardware(crc, bytes, length);
+#endif
+
+    return ~crc32cSoftware(crc, bytes, length);
+}
@@ -32,15 +32,26 @@
 #include "singleapplication_p.h"
 #include <QCryptographicHash>
 #include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
 #include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
 #include <QLocalServer>
 #include <QLocalSocket>
+#include <QMetaMethod>
+#include <QSaveFile>
+#include <QSemaphore>
 #include <QSharedMemory>
+#include <QStandardPaths>
 #include <QThread>
+#include <QTimer>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <limits>
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 10, 0))
 #include <QRandomGenerator>
-#else
-#include <QDateTime>
 #endif
 #ifdef Q_OS_WINDOWS
 #include <QLibrary>
@@ -52,35 +63,64 @@ using lpGetUserNameW = BOOL(WINAPI *)(LPWSTR, LPDWORD);
 static lpGetUserNameW m_lpGetUserNameW = nullptr;
 #endif
 #ifdef Q_OS_UNIX
+#include <cerrno>
 #include <pwd.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <unistd.h>
 #endif
 
+Q_LOGGING_CATEGORY(lcSingleApplicationStartup, "singleapplication.startup", QtWarningMsg)
+
+// Limits of the randomised exponential backoff applied after a collision
+static int m_initialBackoff = 2;
+static int m_maximumBackoff = 64;
+
 SingleApplicationPrivate::SingleApplicationPrivate(SingleApplication *q_ptr) : q_ptr(q_ptr) {}
 
 SingleApplicationPrivate::~SingleApplicationPrivate()
 {
-    if (socket != nullptr) {
-        socket->close();
-        delete socket;
+    const bool isPrimary = server != nullptr;
+
+    // Pending messages of a secondary are flushed without holding the lock
+    if (!isPrimary) {
+        if (ipcThread != nullptr) {
+            stopIpcThread();
+        } else {
+            qDeleteAll(connections);
+            connections.clear();
+            threadConnections.clear();
+            qDeleteAll(channelConnections);
+            channelConnections.clear();
+        }
     }
 
     if (memory != nullptr) {
-        memory->lock();
-        auto *inst = static_cast<InstancesInfo *>(memory->data());
-        if (server != nullptr) {
-            server->close();
-            delete server;
-            inst->primary = false;
-            inst->primaryPid = -1;
-            inst->primaryUser[0] = '\0';
-            inst->checksum = blockChecksum();
-        }
-        memory->unlock();
+        releaseInstanceSlot();
+        lockMemory();
+        if (isPrimary) {
+            if (ipcThread != nullptr) {
+                stopIpcThread();
+            } else {
+                stopServer();
+            }
+            if (isLockFree()) {
+                writePrimaryUser({});
+                atomicInstances()->primaryPid.store(0, std::memory_order_release);
+            } else {
+                auto *inst = instancesInfo();
+                inst->primary = false;
+                inst->primaryPid = -1;
+                inst->primaryUser[0] = '\0';
+                writeBlockChecksum();
+            }
+        }
+        unlockMemory();
 
         delete memory;
     }
+
+    delete stats;
 }
 
 QString SingleApplicationPrivate::getUsername()
@@ -121,374 +161,3007 @@ QString SingleApplicationPrivate::getUsername()
 #endif
 }
 
-void SingleApplicationPrivate::genBlockServerName()
+QString SingleApplicationPrivate::username() const
 {
-    QCryptographicHash appData(QCryptographicHash::Sha256);
-    appData.addData("SingleApplication", 17);
-    appData.addData(QCoreApplication::applicationName().toUtf8());
-    appData.addData(QCoreApplication::organizationName().toUtf8());
-    appData.addData(QCoreApplication::organizationDomain().toUtf8());
+    if (cachedUsername.isEmpty())
+        cachedUsername = getUsername();
+    return cachedUsername;
+}
 
-    if (!appDataList.isEmpty()) {
-        appData.addData(appDataList.join(u"").toUtf8());
-    }
+quint64 SingleApplicationPrivate::currentUid()
+{
+#ifdef Q_OS_UNIX
+    return static_cast<quint64>(geteuid());
+#else
+    // The runtime location is per user already
+    return 0;
+#endif
+}
 
-    if (!(options & SingleApplication::Mode::ExcludeAppVersion)) {
-        appData.addData(QCoreApplication::applicationVersion().toUtf8());
-    }
+void SingleApplicationPrivate::genBlockServerName()
+{
+    // Everything but the username is cheap to collect
+    const auto addAppIdentity = [this](QCryptographicHash &appData){
+        appData.addData("SingleApplication", 17);
+        appData.addData(QCoreApplication::applicationName().toUtf8());
+        appData.addData(QCoreApplication::organizationName().toUtf8());
+        appData.addData(QCoreApplication::organizationDomain().toUtf8());
+
+        if (!appDataList.isEmpty()) {
+            appData.addData(appDataList.join(u"").toUtf8());
+        }
+
+        if (!(options & SingleApplication::Mode::ExcludeAppVersion)) {
+            appData.addData(QCoreApplication::applicationVersion().toUtf8());
+        }
 
-    if (!(options & SingleApplication::Mode::ExcludeAppPath)) {
+        if (!(options & SingleApplication::Mode::ExcludeAppPath)) {
 #ifdef Q_OS_WINDOWS
-        appData.addData(QCoreApplication::applicationFilePath().toLower().toUtf8());
+            appData.addData(QCoreApplication::applicationFilePath().toLower().toUtf8());
 #else
-        appData.addData(QCoreApplication::applicationFilePath().toUtf8());
+            appData.addData(QCoreApplication::applicationFilePath().toUtf8());
 #endif
+        }
+    };
+
+    QString cachePath;
+    if (options & SingleApplication::Mode::CacheBlockName) {
+        QCryptographicHash cacheKey(QCryptographicHash::Sha256);
+        addAppIdentity(cacheKey);
+        cacheKey.addData(QByteArray::number(static_cast<int>(options)));
+        cachePath = blockNameCachePath(cacheKey.result());
+        if (readBlockNameCache(cachePath))
+            return;
     }
 
+    QCryptographicHash appData(QCryptographicHash::Sha256);
+    addAppIdentity(appData);
+
     // User level block requires a user specific data in the hash
     if (options & SingleApplication::Mode::User) {
-        appData.addData(getUsername().toUtf8());
+        appData.addData(username().toUtf8());
     }
 
     // Replace the backslash in RFC 2045 Base64 [a-zA-Z0-9+/=] to comply with
     // server naming requirements.
     blockServerName = QString::fromUtf8(appData.result().toBase64().replace("/", "_"));
+
+    if (!cachePath.isEmpty())
+        writeBlockNameCache(cachePath);
 }
 
-void SingleApplicationPrivate::initializeMemoryBlock() const
+QString SingleApplicationPrivate::blockNameCachePath(const QByteArray &cacheKey)
 {
-    auto *inst = static_cast<InstancesInfo *>(memory->data());
-    inst->primary = false;
-    inst->secondary = 0;
-    inst->primaryPid = -1;
-    inst->primaryUser[0] = '\0';
-    inst->checksum = blockChecksum();
+    const QString location = QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+    if (location.isEmpty())
+        return {};
+
+    return location + QStringLiteral("/SingleApplication-")
+           + QString::fromLatin1(cacheKey.toHex().left(32)) + QStringLiteral(".cache");
 }
 
-void SingleApplicationPrivate::startPrimary()
+qint64 SingleApplicationPrivate::binaryModificationTime()
 {
-    // Reset the number of connections
-    auto *inst = static_cast<InstancesInfo *>(memory->data());
+    const QFileInfo binary(QCoreApplication::applicationFilePath());
+    return binary.lastModified().toMSecsSinceEpoch();
+}
 
-    inst->primary = true;
-    inst->primaryPid = QCoreApplication::applicationPid();
-    qstrncpy(inst->primaryUser, getUsername().toUtf8().data(), sizeof(inst->primaryUser));
-    inst->checksum = blockChecksum();
-    instanceNumber = 0;
-    // Successful creation means that no main process exists
-    // So we start a QLocalServer to listen for connections
-    QLocalServer::removeServer(blockServerName);
-    server = new QLocalServer();
+bool SingleApplicationPrivate::readBlockNameCache(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
 
-    // Restrict access to the socket according to the
-    // SingleApplication::Mode::User flag on User level or no restrictions
-    if (options & SingleApplication::Mode::User) {
-        server->setSocketOptions(QLocalServer::UserAccessOption);
-    } else {
-        server->setSocketOptions(QLocalServer::WorldAccessOption);
-    }
+    QDataStream cacheStream(&file);
+    quint32 version = 0;
+    quint64 uid = 0;
+    qint64 modificationTime = 0;
+    QString name;
+    QString user;
+    cacheStream >> version >> uid >> modificationTime >> name >> user;
+
+    // A rebuilt binary may hash differently, e.g. with a new version
+    if (cacheStream.status() != QDataStream::Ok || version != BlockNameCacheVersion || uid != currentUid()
+        || modificationTime != binaryModificationTime() || name.isEmpty())
+        return false;
+
+    blockServerName = name;
+    if (!user.isEmpty())
+        cachedUsername = user;
 
-    server->listen(blockServerName);
-    connect(server, &QLocalServer::newConnection, this, &SingleApplicationPrivate::slotConnectionEstablished);
+    return true;
 }
 
-void SingleApplicationPrivate::startSecondary()
+void SingleApplicationPrivate::writeBlockNameCache(const QString &path) const
 {
-    auto *inst = static_cast<InstancesInfo *>(memory->data());
+    // Racing instances replace the file atomically
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return;
 
-    inst->secondary += 1;
-    inst->checksum = blockChecksum();
-    instanceNumber = inst->secondary;
+    QDataStream cacheStream(&file);
+    cacheStream << BlockNameCacheVersion << currentUid() << binaryModificationTime() << blockServerName
+                << cachedUsername;
+    if (cacheStream.status() != QDataStream::Ok || !file.commit())
+        qDebug() << "SingleApplication: Unable to write the block name cache" << path;
 }
 
-bool SingleApplicationPrivate::connectToPrimary(int msecs, ConnectionType connectionType)
+bool SingleApplicationPrivate::isLockFree() const
 {
-    QElapsedTimer time;
-    time.start();
+    return options & (SingleApplication::Mode::LockFreeRegistry | SingleApplication::Mode::InstanceTable);
+}
 
-    // Connect to the Local Server of the Primary Instance if not already
-    // connected.
-    if (socket == nullptr) {
-        socket = new QLocalSocket();
-    }
+int SingleApplicationPrivate::blockSize() const
+{
+    if (options & SingleApplication::Mode::InstanceTable)
+        return sizeof(InstanceTableInfo);
+    if (isLockFree())
+        return sizeof(AtomicInstancesInfo);
+    if (options & SingleApplication::Mode::Crc32cChecksums)
+        return sizeof(Crc32cInstancesInfo);
+    return sizeof(InstancesInfo);
+}
 
-    if (socket->state() == QLocalSocket::ConnectedState)
-        return true;
+AtomicInstancesInfo *SingleApplicationPrivate::atomicInstances() const
+{
+    return static_cast<AtomicInstancesInfo *>(memory->data());
+}
 
-    if (socket->state() != QLocalSocket::ConnectedState) {
-        while (true) {
-            randomSleep();
+InstanceTableInfo *SingleApplicationPrivate::instanceTable() const
+{
+    return static_cast<InstanceTableInfo *>(memory->data());
+}
 
-            if (socket->state() != QLocalSocket::ConnectingState)
-                socket->connectToServer(blockServerName);
+InstancesInfo *SingleApplicationPrivate::instancesInfo() const
+{
+    if (options & SingleApplication::Mode::Crc32cChecksums)
+        return &static_cast<Crc32cInstancesInfo *>(memory->data())->info;
+    return static_cast<InstancesInfo *>(memory->data());
+}
 
-            if (socket->state() == QLocalSocket::ConnectingState) {
-                socket->waitForConnected(static_cast<int>(msecs - time.elapsed()));
-            }
+void SingleApplicationPrivate::claimInstanceSlot()
+{
+    if (!(options & SingleApplication::Mode::InstanceTable) || instanceSlot != nullptr)
+        return;
 
-            // If connected break out of the loop
-            if (socket->state() == QLocalSocket::ConnectedState)
+    const auto pid = static_cast<quint32>(QCoreApplication::applicationPid());
+    InstanceSlot *entries = instanceTable()->entries;
+    const auto slotCount = static_cast<int>(sizeof(instanceTable()->entries) / sizeof(entries[0]));
+
+    // Take a free slot, or else one whose owner crashed
+    for (int pass = 0; pass < 2 && instanceSlot == nullptr; ++pass) {
+        for (int i = 0; i < slotCount; ++i) {
+            quint32 expected = entries[i].pid.load(std::memory_order_relaxed);
+            if (pass == 0 ? expected != 0 : isProcessAlive(expected))
+                continue;
+
+            // Free slots have no heartbeat. The heartbeat of a crashed owner
+            // goes first, so readers never see this PID with its fields.
+            qint64 heartbeat = entries[i].heartbeat.load(std::memory_order_relaxed);
+            if (heartbeat != 0 && !entries[i].heartbeat.compare_exchange_strong(heartbeat, 0, std::memory_order_relaxed))
+                continue;
+            if (entries[i].pid.compare_exchange_strong(expected, pid, std::memory_order_acq_rel)) {
+                instanceSlot = &entries[i];
                 break;
-
-            // If elapsed time since start is longer than the method timeout return
-            if (time.elapsed() >= msecs)
-                return false;
+            }
         }
     }
+    if (instanceSlot == nullptr) {
+        qWarning() << "SingleApplication: The instance table is full.";
+        return;
+    }
 
-    // Initialisation message according to the SingleApplication protocol
-    QByteArray initMsg;
-    QDataStream writeStream(&initMsg, QIODevice::WriteOnly);
-
-    writeStream << blockServerName.toLatin1();
-    writeStream << static_cast<quint8>(connectionType);
-    writeStream << instanceNumber;
-#if (QT_VERSION >= QT_VERSION_CHECK(6, 0, 0))
-    quint16 checksum = qChecksum(QByteArray(initMsg, static_cast<quint32>(initMsg.length())));
-#else
-    quint16 checksum = qChecksum(initMsg.constData(), static_cast<quint32>(initMsg.length()));
-#endif
-    writeStream << checksum;
+    // Readers skip the slot until the heartbeat is published
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    instanceSlot->instanceId.store(instanceNumber, std::memory_order_relaxed);
+    instanceSlot->startTime.store(now, std::memory_order_relaxed);
+    instanceSlot->heartbeat.store(now, std::memory_order_release);
 
-    return writeConfirmedMessage(static_cast<int>(msecs - time.elapsed()), initMsg);
+    heartbeatTimer = new QTimer(this);
+    connect(heartbeatTimer, &QTimer::timeout, this, [this](){
+        writeHeartbeat();
+    });
+    heartbeatTimer->start(HeartbeatInterval);
 }
 
-void SingleApplicationPrivate::writeAck(QLocalSocket *sock)
+void SingleApplicationPrivate::releaseInstanceSlot()
 {
-    sock->putChar('\n');
+    if (instanceSlot == nullptr)
+        return;
+
+    delete heartbeatTimer;
+    heartbeatTimer = nullptr;
+    instanceSlot->heartbeat.store(0, std::memory_order_relaxed);
+    instanceSlot->pid.store(0, std::memory_order_release);
+    instanceSlot = nullptr;
 }
 
-bool SingleApplicationPrivate::writeConfirmedMessage(int msecs, const QByteArray &msg)
+void SingleApplicationPrivate::writeHeartbeat() const
 {
-    QElapsedTimer time;
-    time.start();
-
-    // Frame 1: The header indicates the message length that follows
-    QByteArray header;
-    QDataStream headerStream(&header, QIODevice::WriteOnly);
-
-    headerStream << static_cast<quint64>(msg.length());
-
-    if(!writeConfirmedFrame(static_cast<int>(msecs - time.elapsed()), header))
-        return false;
-
-    // Frame 2: The message
-    return writeConfirmedFrame(static_cast<int>(msecs - time.elapsed()), msg);
+    instanceSlot->heartbeat.store(QDateTime::currentMSecsSinceEpoch(), std::memory_order_release);
 }
 
-bool SingleApplicationPrivate::writeConfirmedFrame(int msecs, const QByteArray &msg)
+QList<SingleApplication::RunningInstance> SingleApplicationPrivate::runningInstances() const
 {
-    socket->write(msg);
-    socket->flush();
-
-    bool result = socket->waitForReadyRead(msecs); // await ack byte
-    if (result) {
-        socket->read(1);
-        return true;
+    QList<SingleApplication::RunningInstance> instances;
+    if (!(options & SingleApplication::Mode::InstanceTable) || memory == nullptr)
+        return instances;
+
+    const quint32 primary = atomicInstances()->primaryPid.load(std::memory_order_acquire);
+    for (const InstanceSlot &slot : instanceTable()->entries) {
+        const quint32 pid = slot.pid.load(std::memory_order_acquire);
+        if (pid == 0)
+            continue;
+        const qint64 heartbeat = slot.heartbeat.load(std::memory_order_acquire);
+        if (heartbeat == 0 || !isProcessAlive(pid))
+            continue;
+
+        SingleApplication::RunningInstance instance;
+        instance.instanceId = slot.instanceId.load(std::memory_order_relaxed);
+        instance.pid = pid;
+        instance.startTime = slot.startTime.load(std::memory_order_relaxed);
+        instance.heartbeat = heartbeat;
+        instance.primary = pid == primary;
+
+        // The slot has been reclaimed while it was read
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.pid.load(std::memory_order_relaxed) != pid)
+            continue;
+        instances.append(instance);
     }
 
-    return false;
+    return instances;
 }
 
-quint16 SingleApplicationPrivate::blockChecksum() const
+bool SingleApplicationPrivate::lockMemory() const
 {
-#if (QT_VERSION >= QT_VERSION_CHECK(6, 0, 0))
-    quint16 checksum = qChecksum(QByteArray(static_cast<const char *>(memory->constData()),
-                                            offsetof(InstancesInfo, checksum)));
-#else
-    quint16 checksum = qChecksum(static_cast<const char *>(memory->constData()),
-                                 offsetof(InstancesInfo, checksum));
-#endif
-    return checksum;
+    // The lock free registry never takes the system semaphore
+    if (isLockFree())
+        return true;
+
+    return memory->lock();
 }
 
-qint64 SingleApplicationPrivate::primaryPid() const
+bool SingleApplicationPrivate::unlockMemory() const
 {
-    qint64 pid;
-
-    memory->lock();
-    auto *inst = static_cast<InstancesInfo *>(memory->data());
-    pid = inst->primaryPid;
-    memory->unlock();
+    if (isLockFree())
+        return true;
 
-    return pid;
+    return memory->unlock();
 }
 
-QString SingleApplicationPrivate::primaryUser() const
+bool SingleApplicationPrivate::isBlockConsistent() const
 {
-    QByteArray username;
+    // Every state of the lock free registry is consistent
+    if (isLockFree())
+        return true;
 
-    memory->lock();
-    auto *inst = static_cast<InstancesInfo *>(memory->data());
-    username = inst->primaryUser;
-    memory->unlock();
+    return blockChecksum() == storedBlockChecksum();
+}
 
-    return QString::fromUtf8(username);
+quint32 SingleApplicationPrivate::blockMagic() const
+{
+    if (options & SingleApplication::Mode::InstanceTable)
+        return InstanceTableBlockMagic;
+    if (isLockFree())
+        return LockFreeBlockMagic;
+    if (options & SingleApplication::Mode::Crc32cChecksums)
+        return Crc32cBlockMagic;
+    return 0;
 }
 
-/**
- * @brief Executed when a connection has been made to the LocalServer
- */
-void SingleApplicationPrivate::slotConnectionEstablished()
+bool SingleApplicationPrivate::isBlockZeroFilled() const
 {
-    QLocalSocket *nextConnSocket = server->nextPendingConnection();
-    connectionMap.insert(nextConnSocket, ConnectionInfo());
+    const auto *data = static_cast<const char *>(memory->constData());
+    const int size = qMin(memory->size(), blockSize());
+    return std::all_of(data, data + size, [](char c){ return c == 0; });
+}
 
-    connect(nextConnSocket, &QLocalSocket::aboutToClose, this, [nextConnSocket, this](){
-        auto &info = connectionMap[nextConnSocket];
-        slotClientConnectionClosed(nextConnSocket, info.instanceId);
-    });
+bool SingleApplicationPrivate::isBlockLayoutCompatible() const
+{
+    // Instances with other options or of other versions of the library may
+    // share the name of the block. A block which is still zero filled hasn't
+    // been initialised by its creator yet.
+    const quint32 magic = blockMagic();
+    if (isLockFree()) {
+        auto &stored = atomicInstances()->magic;
+        quint32 current = stored.load(std::memory_order_acquire);
+        if (current == 0 && isBlockZeroFilled()
+            && stored.compare_exchange_strong(current, magic, std::memory_order_acq_rel, std::memory_order_acquire))
+            current = magic;
+        if (current != magic)
+            return false;
+    } else {
+        quint32 current = 0;
+        memcpy(&current, memory->constData(), sizeof(current));
+        if (magic == 0 ? current > 1 : current != magic && (current != 0 || !isBlockZeroFilled()))
+            return false;
+    }
 
-    connect(nextConnSocket, &QLocalSocket::disconnected, nextConnSocket, &QLocalSocket::deleteLater);
+    if (!(options & SingleApplication::Mode::InstanceTable))
+        return true;
 
-    connect(nextConnSocket, &QLocalSocket::destroyed, this, [nextConnSocket, this](){
-        connectionMap.remove(nextConnSocket);
-    });
+    // The instance which created the block may not have initialised it yet
+    auto *table = instanceTable();
+    if (table->version.load(std::memory_order_acquire) == 0)
+        initializeMemoryBlock();
 
-    connect(nextConnSocket, &QLocalSocket::readyRead, this, [nextConnSocket, this](){
-        auto &info = connectionMap[nextConnSocket];
-        switch (static_cast<ConnectionStage>(info.stage)) {
-        case ConnectionStage::StageInitHeader:
-            readMessageHeader(nextConnSocket, ConnectionStage::StageInitBody);
-            break;
-        case ConnectionStage::StageInitBody:
-            readInitMessageBody(nextConnSocket);
-            break;
-        case ConnectionStage::StageConnectedHeader:
-            readMessageHeader(nextConnSocket, ConnectionStage::StageConnectedBody);
-            break;
-        case ConnectionStage::StageConnectedBody:
-            slotDataAvailable(nextConnSocket, info.instanceId);
-            break;
-        default:
-            break;
-        };
-    });
+    return table->version.load(std::memory_order_acquire) == InstanceTableVersion
+        && table->slotCount.load(std::memory_order_relaxed) == sizeof(table->entries) / sizeof(table->entries[0]);
 }
 
-void SingleApplicationPrivate::readMessageHeader(QLocalSocket *sock, SingleApplicationPrivate::ConnectionStage nextStage)
+void SingleApplicationPrivate::initializeMemoryBlock() const
 {
-    if (!connectionMap.contains(sock)) {
-        return;
-    }
-
-    if (sock->bytesAvailable() < static_cast<qint64>(sizeof(quint64))) {
+    // A freshly created block is zero filled by the operating system, which is
+    // the initial state of the lock free registry. Other instances may already
+    // have claimed it, so it must not be reset.
+    if (isLockFree()) {
+        // Instances attaching before the creator got here do the same
+        quint32 expected = 0;
+        atomicInstances()->magic.compare_exchange_strong(expected, blockMagic(), std::memory_order_acq_rel,
+                                                         std::memory_order_relaxed);
+        if (options & SingleApplication::Mode::InstanceTable) {
+            auto *table = instanceTable();
+            table->slotCount.store(static_cast<quint32>(sizeof(table->entries) / sizeof(table->entries[0])),
+                                   std::memory_order_relaxed);
+            quint32 expected = 0;
+            table->version.compare_exchange_strong(expected, InstanceTableVersion, std::memory_order_release,
+                                                   std::memory_order_relaxed);
+        }
         return;
     }
 
-    QDataStream headerStream(sock);
-
-    // Read the header to know the message length
-    quint64 msgLen = 0;
-    headerStream >> msgLen;
-    ConnectionInfo &info = connectionMap[sock];
-    info.stage = static_cast<quint8>(nextStage);
-    info.msgLen = msgLen;
-
-    writeAck(sock);
+    if (options & SingleApplication::Mode::Crc32cChecksums)
+        static_cast<Crc32cInstancesInfo *>(memory->data())->magic = Crc32cBlockMagic;
+    auto *inst = instancesInfo();
+    inst->primary = false;
+    inst->secondary = 0;
+    inst->primaryPid = -1;
+    inst->primaryUser[0] = '\0';
+    writeBlockChecksum();
 }
 
-bool SingleApplicationPrivate::isFrameComplete(QLocalSocket *sock)
+bool SingleApplicationPrivate::recoverMemoryBlock() const
 {
-    if (!connectionMap.contains(sock)) {
-        return false;
-    }
+    auto *inst = instancesInfo();
 
-    ConnectionInfo &info = connectionMap[sock];
-    if (sock->bytesAvailable() < static_cast<qint64>(info.msgLen)) {
+    // Still zero filled, the instance which created the block is about to
+    // initialise it
+    if (!inst->primary && inst->primaryPid == 0 && inst->secondary == 0)
         return false;
+
+    // The lock is held, so the last writer died while updating the block.
+    // Only take over if that has been the primary instance.
+    if (inst->primary && isProcessAlive(inst->primaryPid)) {
+        qWarning() << "SingleApplication: Repairing the shared memory block of primary instance" << inst->primaryPid;
+        writeBlockChecksum();
+    } else {
+        qWarning() << "SingleApplication: Shared memory block left inconsistent by a crashed instance.";
+        initializeMemoryBlock();
     }
 
     return true;
 }
 
-void SingleApplicationPrivate::readInitMessageBody(QLocalSocket *sock)
+bool SingleApplicationPrivate::claimPrimary() const
 {
-    Q_Q(SingleApplication);
+    if (isLockFree()) {
+        quint32 expected = 0;
+        const auto pid = static_cast<quint32>(QCoreApplication::applicationPid());
+        auto &primaryPid = atomicInstances()->primaryPid;
+        if (primaryPid.compare_exchange_strong(expected, pid, std::memory_order_acq_rel))
+            return true;
+
+        // Replace a primary instance which crashed, a reused PID just keeps
+        // it registered
+        if (isProcessAlive(expected) || !primaryPid.compare_exchange_strong(expected, pid, std::memory_order_acq_rel))
+            return false;
+        qWarning() << "SingleApplication: Taking over from crashed primary instance" << expected;
+        return true;
+    }
 
-    if(!isFrameComplete(sock))
-        return;
+    auto *inst = instancesInfo();
+    if (inst->primary == false)
+        return true;
 
-    // Read the message body
-    QByteArray msgBytes = sock->readAll();
-    QDataStream readStream(msgBytes);
+    if (isProcessAlive(inst->primaryPid))
+        return false;
+    qWarning() << "SingleApplication: Taking over from crashed primary instance" << inst->primaryPid;
+    return true;
+}
 
-    // server name
-    QByteArray latin1Name;
-    readStream >> latin1Name;
+bool SingleApplicationPrivate::releaseStalePrimary(int msecs)
+{
+    // The PID of a crashed primary instance may have been reused by an
+    // unrelated process, which keeps it looking alive. Nobody answering at the
+    // server name proves it gone, a busy primary still accepts or times out.
+    const auto isListening = [this, msecs]() {
+        QLocalSocket probe;
+        probe.connectToServer(blockServerName);
+        if (probe.state() == QLocalSocket::ConnectingState)
+            probe.waitForConnected(msecs);
+        if (probe.state() == QLocalSocket::ConnectedState) {
+            probe.abort();
+            return true;
+        }
+        return probe.error() != QLocalSocket::ServerNotFoundError
+            && probe.error() != QLocalSocket::ConnectionRefusedError;
+    };
+
+    if (isLockFree()) {
+        auto &primaryPid = atomicInstances()->primaryPid;
+        quint32 expected = primaryPid.load(std::memory_order_acquire);
+        if (expected == 0)
+            return true;
+
+        // A primary which just claimed the registry may not listen yet
+        if (isListening())
+            return false;
+        int attempt = 0;
+        backoff(attempt, msecs);
+        if (isListening() || !primaryPid.compare_exchange_strong(expected, 0, std::memory_order_acq_rel))
+            return false;
+        qWarning() << "SingleApplication: Taking over from unreachable primary instance" << expected;
+        return true;
+    }
 
-    // connection type
-    ConnectionType connectionType = ConnectionType::InvalidConnection;
-    quint8 connTypeVal = static_cast<quint8>(ConnectionType::InvalidConnection);
-    readStream >> connTypeVal;
-    connectionType = static_cast<ConnectionType>(connTypeVal);
+    // The lock is held and a primary listens before releasing it
+    auto *inst = instancesInfo();
+    if (inst->primary == false)
+        return true;
+    if (isListening())
+        return false;
 
-    // instance id
-    quint32 instanceId = 0;
-    readStream >> instanceId;
+    qWarning() << "SingleApplication: Taking over from unreachable primary instance" << inst->primaryPid;
+    inst->primary = false;
+    inst->primaryPid = -1;
+    writeBlockChecksum();
+    return true;
+}
 
-    // checksum
-    quint16 msgChecksum = 0;
-    readStream >> msgChecksum;
+bool SingleApplicationPrivate::isProcessAlive(qint64 pid)
+{
+    if (pid <= 0)
+        return false;
 
-#if (QT_VERSION >= QT_VERSION_CHECK(6, 0, 0))
-    const quint16 actualChecksum = qChecksum(QByteArray(msgBytes, static_cast<quint32>(msgBytes.length() - sizeof(quint16))));
+#ifdef Q_OS_WINDOWS
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, static_cast<DWORD>(pid));
+    if (process == nullptr)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+
+    DWORD exitCode = 0;
+    const bool alive = GetExitCodeProcess(process, &exitCode) && exitCode == STILL_ACTIVE;
+    CloseHandle(process);
+    return alive;
+#elif defined(Q_OS_UNIX)
+    // Signal 0 only checks for existence and permission
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
 #else
-    const quint16 actualChecksum = qChecksum(msgBytes.constData(), static_cast<quint32>(msgBytes.length() - sizeof(quint16)));
+    return true;
 #endif
+}
 
-    bool isValid = readStream.status() == QDataStream::Ok && QLatin1String(latin1Name) == blockServerName && msgChecksum == actualChecksum;
-
-    if (!isValid) {
-        sock->close();
-        return;
-    }
-
-    ConnectionInfo &info = connectionMap[sock];
-    info.instanceId = instanceId;
-    info.stage = static_cast<quint8>(ConnectionStage::StageConnectedHeader);
-
-    if (connectionType == ConnectionType::NewInstance
-        || (connectionType == ConnectionType::SecondaryInstance
-            && options & SingleApplication::Mode::SecondaryNotification)) {
-        Q_EMIT q->instanceStarted();
-    }
+void SingleApplicationPrivate::writePrimaryUser(const QByteArray &username) const
+{
+    auto *inst = atomicInstances();
 
-    writeAck(sock);
+    // Seqlock: an odd sequence tells readers a write is in progress
+    inst->sequence.fetch_add(1, std::memory_order_acq_rel);
+    qstrncpy(inst->primaryUser, username.constData(), sizeof(inst->primaryUser));
+    inst->sequence.fetch_add(1, std::memory_order_release);
 }
 
-void SingleApplicationPrivate::slotDataAvailable(QLocalSocket *dataSocket, quint32 instanceId)
+void SingleApplicationPrivate::startPrimary()
 {
-    Q_Q(SingleApplication);
+    if (isLockFree()) {
+        // The PID has already been published by claimPrimary()
+        writePrimaryUser(username().toUtf8());
+    } else {
+        auto *inst = instancesInfo();
 
-    if (!isFrameComplete(dataSocket))
-        return;
+        inst->primary = true;
+        inst->primaryPid = QCoreApplication::applicationPid();
+        qstrncpy(inst->primaryUser, username().toUtf8().data(), sizeof(inst->primaryUser));
+        writeBlockChecksum();
+    }
+    instanceNumber = 0;
+    claimInstanceSlot();
 
-    Q_EMIT q->receivedMessage(instanceId, dataSocket->readAll());
+    // The server and its connections are driven by the IPC thread, which
+    // only hands complete messages to the main thread.
+    if (options & SingleApplication::Mode::IpcThread) {
+        startIpcThread();
 
-    writeAck(dataSocket);
+        IpcRequest request;
+        request.kind = IpcRequest::Kind::Listen;
+        submitRequest(request);
+        return;
+    }
 
-    ConnectionInfo &info = connectionMap[dataSocket];
-    info.stage = static_cast<quint8>(ConnectionStage::StageConnectedHeader);
+    startServer();
 }
 
-void SingleApplicationPrivate::slotClientConnectionClosed(QLocalSocket *closedSocket,
-                                                          quint32 instanceId)
+void SingleApplicationPrivate::startServer()
 {
-    if (closedSocket->bytesAvailable() > 0)
-        slotDataAvailable(closedSocket, instanceId);
-}
+    // Successful creation means that no main process exists
+    // So we start a QLocalServer to listen for connections
+    server = new QLocalServer();
 
-void SingleApplicationPrivate::randomSleep()
-{
+    // Restrict access to the socket according to the
+    // SingleApplication::Mode::User flag on User level or no restrictions
+    if (options & SingleApplication::Mode::User) {
+        server->setSocketOptions(QLocalServer::UserAccessOption);
+    } else {
+        server->setSocketOptions(QLocalServer::WorldAccessOption);
+    }
+
+    // Only the primary instance gets here, so a socket file which is still in
+    // place was left by a crashed one and can be removed
+    if (!server->listen(blockServerName) && server->serverError() == QAbstractSocket::AddressInUseError) {
+        QLocalServer::removeServer(blockServerName);
+        server->listen(blockServerName);
+    }
+    connect(server, &QLocalServer::newConnection, ipcContext(), [this](){
+        slotConnectionEstablished();
+    });
+}
+
+void SingleApplicationPrivate::stopServer()
+{
+    if (server == nullptr)
+        return;
+
+    // Accepted connections are children of the server
+    server->close();
+    delete server;
+    server = nullptr;
+}
+
+QObject *SingleApplicationPrivate::ipcContext()
+{
+    if (ipcWorker != nullptr)
+        return ipcWorker;
+    return this;
+}
+
+void SingleApplicationPrivate::startSecondary()
+{
+    if (options & SingleApplication::Mode::IpcThread)
+        startIpcThread();
+
+    if (isLockFree()) {
+        instanceNumber = atomicInstances()->secondary.fetch_add(1, std::memory_order_relaxed) + 1;
+        claimInstanceSlot();
+        return;
+    }
+
+    auto *inst = instancesInfo();
+
+    inst->secondary += 1;
+    writeBlockChecksum();
+    instanceNumber = inst->secondary;
+}
+
+QByteArray SingleApplicationPrivate::initMessage(ConnectionType connectionType) const
+{
+    // Initialisation message according to the SingleApplication protocol
+    QByteArray initMsg;
+    QDataStream writeStream(&initMsg, QIODevice::WriteOnly);
+
+    writeStream << blockServerName.toLatin1();
+    writeStream << static_cast<quint8>(connectionType);
+    writeStream << instanceNumber;
+#if (QT_VERSION >= QT_VERSION_CHECK(6, 0, 0))
+    quint16 checksum = qChecksum(QByteArrayView(initMsg));
+#else
+    quint16 checksum = qChecksum(initMsg.constData(), static_cast<quint32>(initMsg.length()));
+#endif
+    writeStream << checksum;
+
+    return initMsg;
+}
+
+PrimaryConnection *SingleApplicationPrivate::connection(const QThread *sender)
+{
+    if (connections.isEmpty())
+        connections.append(new PrimaryConnection(this));
+
+    // Senders are spread over the pool by thread and keep their connection
+    // when the pool is resized, which keeps the messages of every thread in
+    // order.
+    if (sender == nullptr)
+        sender = QThread::currentThread();
+    PrimaryConnection *&connection = threadConnections[sender];
+    if (connection == nullptr) {
+        const auto index = qHash(static_cast<const void *>(sender)) % connections.size();
+        connection = connections.at(static_cast<int>(index));
+    }
+    return connection;
+}
+
+PrimaryConnection *SingleApplicationPrivate::channelConnection(const QString &channel)
+{
+    // Every channel has a socket of its own and never waits for the frames
+    // of another one.
+    PrimaryConnection *&connection = channelConnections[channel];
+    if (connection == nullptr)
+        connection = new PrimaryConnection(this, channel);
+
+    return connection;
+}
+
+bool SingleApplicationPrivate::connectToPrimary(int msecs, ConnectionType connectionType)
+{
+    if (options & SingleApplication::Mode::IpcThread) {
+        startIpcThread();
+
+        IpcRequest request;
+        request.kind = IpcRequest::Kind::Connect;
+        request.connectionType = static_cast<quint8>(connectionType);
+        request.timeout = msecs;
+        return submitRequest(request);
+    }
+
+    return connection()->connectToPrimary(msecs, connectionType);
+}
+
+bool SingleApplicationPrivate::sendMessage(const QByteArray &message, int msecs, quint64 flags)
+{
+    if (ipcThread != nullptr) {
+        IpcRequest request;
+        request.kind = IpcRequest::Kind::Message;
+        request.message = message;
+        request.frameFlags = flags;
+        request.timeout = msecs;
+        return submitRequest(request);
+    }
+
+    if (!isIpcThreadCaller(flags & BatchFrame ? "sendMessages()" : "sendMessage()"))
+        return false;
+
+    PrimaryConnection *primary = connection();
+    const bool ok = primary->sendMessage(message, msecs, flags);
+    lastSendError.store(static_cast<int>(primary->sendError), std::memory_order_relaxed);
+
+    return ok;
+}
+
+bool SingleApplicationPrivate::sendMessages(const QList<QByteArray> &messages, int msecs)
+{
+    // Primaries without the extended protocol only understand single messages
+    if (!(options & SingleApplication::Mode::ExtendedProtocol)) {
+        QElapsedTimer time;
+        time.start();
+        for (const QByteArray &message : messages) {
+            if (!sendMessage(message, static_cast<int>(msecs - time.elapsed())))
+                return false;
+        }
+        return true;
+    }
+
+    if (messages.isEmpty())
+        return true;
+
+    qint64 size = sizeof(quint32);
+    for (const QByteArray &message : messages)
+        size += sizeof(quint32) + message.size();
+
+    // The whole batch is a single frame and is acknowledged as a unit
+    QByteArray batch;
+    batch.reserve(static_cast<decltype(batch.size())>(size));
+    QDataStream batchStream(&batch, QIODevice::WriteOnly);
+    batchStream << messages;
+
+    return sendMessage(batch, msecs, BatchFrame);
+}
+
+bool SingleApplicationPrivate::sendChannelMessage(const QString &channel, const QByteArray &message, int msecs)
+{
+    if (channel.isEmpty())
+        return sendMessage(message, msecs);
+
+    // Only the extended protocol can name the channel of a connection
+    if (!(options & SingleApplication::Mode::ExtendedProtocol)) {
+        qWarning() << "SingleApplication: sendChannelMessage() requires Mode::ExtendedProtocol.";
+        return false;
+    }
+
+    if (ipcThread != nullptr) {
+        IpcRequest request;
+        request.kind = IpcRequest::Kind::Message;
+        request.message = message;
+        request.channel = channel;
+        request.timeout = msecs;
+        return submitRequest(request);
+    }
+
+    if (!isIpcThreadCaller("sendChannelMessage()"))
+        return false;
+
+    PrimaryConnection *primary = channelConnection(channel);
+    const bool ok = primary->sendMessage(message, msecs);
+    lastSendError.store(static_cast<int>(primary->sendError), std::memory_order_relaxed);
+
+    return ok;
+}
+
+quint64 SingleApplicationPrivate::sendMessageAsync(const QByteArray &message, int msecs)
+{
+    if (ipcThread != nullptr) {
+        // The identifier is known up front, the caller doesn't wait for the
+        // request to be picked up.
+        auto *request = new IpcRequest;
+        request->kind = IpcRequest::Kind::AsyncMessage;
+        request->message = message;
+        request->timeout = msecs;
+        request->messageId = ++lastMessageId;
+        const quint64 messageId = request->messageId;
+        postRequest(request);
+        return messageId;
+    }
+
+    if (!isIpcThreadCaller("sendMessageAsync()"))
+        return 0;
+
+    return connection()->queueAsyncMessage(message, msecs, true);
+}
+
+bool SingleApplicationPrivate::handOffToPrimary(int msecs)
+{
+    // Tried before the IPC thread exists, the connection is only kept if the
+    // process is about to exit anyway.
+    auto *probe = new PrimaryConnection(this);
+    if (probe->connectToPrimary(msecs, ConnectionType::NewInstance, false)) {
+        connections.append(probe);
+        return true;
+    }
+
+    delete probe;
+    return false;
+}
+
+void SingleApplicationPrivate::setConnectionPoolSize(int size)
+{
+    if (ipcThread != nullptr) {
+        IpcRequest request;
+        request.kind = IpcRequest::Kind::PoolSize;
+        request.timeout = size;
+        submitRequest(request);
+        return;
+    }
+
+    if (isIpcThreadCaller("setConnectionPoolSize()"))
+        resizeConnectionPool(size);
+}
+
+bool SingleApplicationPrivate::flushMessages(int msecs)
+{
+    if (ipcThread != nullptr) {
+        IpcRequest request;
+        request.kind = IpcRequest::Kind::Flush;
+        request.timeout = msecs;
+        return submitRequest(request);
+    }
+
+    if (!isIpcThreadCaller("flushMessages()"))
+        return false;
+
+    return flushConnections(msecs);
+}
+
+void SingleApplicationPrivate::resizeConnectionPool(int size)
+{
+    size = qMax(1, size);
+
+    // The threads of a removed connection only move on once its messages
+    // have been acknowledged
+    while (connections.size() > size) {
+        PrimaryConnection *connection = connections.takeLast();
+        connection->flushMessages(timeout);
+        for (auto it = threadConnections.begin(); it != threadConnections.end();) {
+            if (it.value() == connection)
+                it = threadConnections.erase(it);
+            else
+                ++it;
+        }
+        delete connection;
+    }
+
+    // Connect the additional sockets ahead of the first message
+    while (connections.size() < size) {
+        auto *connection = new PrimaryConnection(this);
+        connections.append(connection);
+        connection->open();
+    }
+}
+
+bool SingleApplicationPrivate::flushConnections(int msecs)
+{
+    QElapsedTimer time;
+    time.start();
+
+    bool result = true;
+    for (PrimaryConnection *connection : std::as_const(connections))
+        result = connection->flushMessages(static_cast<int>(msecs - time.elapsed())) && result;
+    for (PrimaryConnection *connection : std::as_const(channelConnections))
+        result = connection->flushMessages(static_cast<int>(msecs - time.elapsed())) && result;
+
+    return result;
+}
+
+bool SingleApplicationPrivate::isIpcThreadCaller(const char *function) const
+{
+    // The sockets belong to the thread of the application object
+    if (QThread::currentThread() == thread())
+        return true;
+
+    qWarning() << "SingleApplication:" << function
+               << "called from a foreign thread, this requires Mode::IpcThread.";
+    return false;
+}
+
+void SingleApplicationPrivate::startIpcThread()
+{
+    if (ipcThread != nullptr)
+        return;
+
+    ipcThread = new QThread();
+    ipcThread->setObjectName(QStringLiteral("SingleApplication IPC"));
+    ipcWorker = new IpcWorker(this);
+    ipcWorker->moveToThread(ipcThread);
+    ipcThread->start();
+}
+
+void SingleApplicationPrivate::stopIpcThread()
+{
+    // The sockets have to be destroyed by the thread owning them
+    IpcRequest request;
+    request.kind = IpcRequest::Kind::Shutdown;
+    submitRequest(request);
+
+    ipcThread->quit();
+    ipcThread->wait();
+    delete ipcWorker;
+    ipcWorker = nullptr;
+    delete ipcThread;
+    ipcThread = nullptr;
+}
+
+bool SingleApplicationPrivate::submitRequest(IpcRequest &request)
+{
+    QSemaphore done;
+    request.done = &done;
+
+    // Slots connected to the IPC thread's signals can't wait for themselves
+    if (QThread::currentThread() == ipcThread) {
+        request.sender = ipcThread;
+        processRequest(&request);
+        return request.result;
+    }
+
+    postRequest(&request);
+    done.acquire();
+
+    return request.result;
+}
+
+void SingleApplicationPrivate::postRequest(IpcRequest *request)
+{
+    request->sender = QThread::currentThread();
+    ipcRequests.push(request);
+
+    // Only wake the IPC thread if it isn't about to drain the queue anyway
+    if (!ipcWakePending.exchange(true, std::memory_order_acq_rel))
+        QMetaObject::invokeMethod(ipcWorker, "processRequests", Qt::QueuedConnection);
+}
+
+void SingleApplicationPrivate::processRequests()
+{
+    // Cleared first, a request pushed from now on posts another wake up. The
+    // exchange acquires the pushes which saw the flag still set.
+    ipcWakePending.exchange(false, std::memory_order_acq_rel);
+
+    while (IpcRequest *request = ipcRequests.pop())
+        processRequest(request);
+}
+
+void SingleApplicationPrivate::processRequest(IpcRequest *request)
+{
+    // Blocking requests are served one after another. Pipelined messages only
+    // block the IPC thread while the window of unacknowledged messages is full.
+    switch (request->kind) {
+    case IpcRequest::Kind::Connect:
+        request->result = connection(request->sender)->connectToPrimary(
+            request->timeout, static_cast<ConnectionType>(request->connectionType));
+        break;
+    case IpcRequest::Kind::Message: {
+        PrimaryConnection *primary = request->channel.isEmpty()
+            ? connection(request->sender) : channelConnection(request->channel);
+        request->result = primary->sendMessage(request->message, request->timeout, request->frameFlags);
+        lastSendError.store(static_cast<int>(primary->sendError), std::memory_order_relaxed);
+        break;
+    }
+    case IpcRequest::Kind::AsyncMessage:
+        connection(request->sender)->queueAsyncMessage(request->message, request->timeout, true, request->messageId);
+        delete request;
+        return;
+    case IpcRequest::Kind::Flush:
+        request->result = flushConnections(request->timeout);
+        break;
+    case IpcRequest::Kind::PoolSize:
+        resizeConnectionPool(request->timeout);
+        request->result = true;
+        break;
+    case IpcRequest::Kind::Listen:
+        startServer();
+        request->result = true;
+        break;
+    case IpcRequest::Kind::InstanceMessage:
+        request->result = writeInstanceMessage(static_cast<quint32>(request->messageId), request->message);
+        break;
+    case IpcRequest::Kind::Broadcast:
+        request->delivered = writeBroadcastMessage(request->message);
+        request->result = request->delivered > 0;
+        break;
+    case IpcRequest::Kind::Shutdown:
+        qDeleteAll(connections);
+        connections.clear();
+        threadConnections.clear();
+        qDeleteAll(channelConnections);
+        channelConnections.clear();
+        stopServer();
+        request->result = true;
+        break;
+    }
+
+    request->done->release();
+}
+
+IpcRequestQueue::IpcRequestQueue() : head(&stub), tail(&stub) {}
+
+void IpcRequestQueue::push(IpcRequest *request)
+{
+    request->next.store(nullptr, std::memory_order_relaxed);
+    IpcRequest *previous = head.exchange(request, std::memory_order_acq_rel);
+    previous->next.store(request, std::memory_order_release);
+}
+
+IpcRequest *IpcRequestQueue::pop()
+{
+    IpcRequest *first = tail;
+    IpcRequest *next = first->next.load(std::memory_order_acquire);
+
+    if (first == &stub) {
+        if (next == nullptr)
+            return nullptr;
+        tail = next;
+        first = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+        tail = next;
+        return first;
+    }
+
+    // A producer is between its exchange and linking the request, the woken
+    // IPC thread will see it on its next wake up.
+    if (first != head.load(std::memory_order_acquire))
+        return nullptr;
+
+    // Keep one node in the queue so the last request can be handed out
+    push(&stub);
+    next = first->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+        tail = next;
+        return first;
+    }
+
+    return nullptr;
+}
+
+QByteArray SingleApplicationPrivate::frameHeader(qint64 length, quint64 flags)
+{
+    QByteArray header(sizeof(quint64), Qt::Uninitialized);
+    qToBigEndian(static_cast<quint64>(length) | flags, header.data());
+
+    return header;
+}
+
+PrimaryConnection::PrimaryConnection(SingleApplicationPrivate *d, const QString &channel) : d(d), channel(channel)
+{
+    socket = new QLocalSocket(this);
+
+    // Acknowledgements are consumed from the signals so that blocking and
+    // asynchronous messages can share the connection.
+    connect(socket, &QLocalSocket::readyRead, this, &PrimaryConnection::slotAcksAvailable);
+    connect(socket, &QLocalSocket::stateChanged, this, [this](){
+        slotSocketStateChanged();
+    });
+}
+
+PrimaryConnection::~PrimaryConnection()
+{
+    // Pipelined messages may still sit in the socket buffers. Give the
+    // primary instance a chance to receive them before closing.
+    if (socket->state() == QLocalSocket::ConnectedState) {
+        // Nobody is left to be notified about asynchronous messages
+        for (AsyncMessage &message : asyncMessages)
+            message.notify = false;
+        flushMessages(d->timeout);
+    }
+    socket->disconnect(this);
+    socket->close();
+
+    delete dataMemory;
+}
+
+void PrimaryConnection::open()
+{
+    if (socket->state() != QLocalSocket::UnconnectedState)
+        return;
+
+    // The connection is initialised from slotSocketStateChanged()
+    asyncConnecting = true;
+    socket->connectToServer(d->blockServerName);
+}
+
+QByteArray PrimaryConnection::initMessage(SingleApplicationPrivate::ConnectionType connectionType, quint64 &flags)
+{
+    // Reconnects of the extended protocol only present the session token,
+    // which doesn't carry the channel.
+    if (connectionType == SingleApplicationPrivate::ConnectionType::Reconnect && d->sessionToken != 0
+        && (d->options & SingleApplication::Mode::ExtendedProtocol) && channel.isEmpty()) {
+        QByteArray resumeMsg;
+        QDataStream writeStream(&resumeMsg, QIODevice::WriteOnly);
+        writeStream << d->sessionToken;
+        flags = SingleApplicationPrivate::ResumeFrame;
+        resuming = true;
+        return resumeMsg;
+    }
+
+    flags = 0;
+    QByteArray initMsg = d->initMessage(connectionType);
+
+    // The first connection of the instance may deliver its first message
+    // within the handshake, whatever made it connect
+    if (d->hasInitPayload && channel.isEmpty() && (d->options & SingleApplication::Mode::ExtendedProtocol)) {
+        QDataStream writeStream(&initMsg, QIODevice::WriteOnly | QIODevice::Append);
+        writeStream << d->initPayload;
+        flags = SingleApplicationPrivate::InitPayloadFrame;
+    }
+
+    if (!channel.isEmpty()) {
+        QDataStream writeStream(&initMsg, QIODevice::WriteOnly | QIODevice::Append);
+        writeStream << channel.toUtf8();
+        flags |= SingleApplicationPrivate::ChannelFrame;
+    }
+
+    return initMsg;
+}
+
+bool PrimaryConnection::connectToPrimary(int msecs, SingleApplicationPrivate::ConnectionType connectionType, bool retry)
+{
+    QElapsedTimer time;
+    time.start();
+
+    // Connect to the Local Server of the Primary Instance if not already
+    // connected.
+    if (socket->state() == QLocalSocket::ConnectedState)
+        return true;
+
+    if (socket->state() != QLocalSocket::ConnectedState) {
+        int attempt = 0;
+        while (true) {
+            if (socket->state() != QLocalSocket::ConnectingState)
+                socket->connectToServer(d->blockServerName);
+
+            if (socket->state() == QLocalSocket::ConnectingState) {
+                socket->waitForConnected(static_cast<int>(msecs - time.elapsed()));
+            }
+
+            // If connected break out of the loop
+            if (socket->state() == QLocalSocket::ConnectedState)
+                break;
+
+            // Nobody is listening, the caller has a fallback
+            if (!retry) {
+                socket->abort();
+                return false;
+            }
+
+            // If elapsed time since start is longer than the method timeout return
+            if (time.elapsed() >= msecs)
+                return false;
+
+            // The server is not listening yet or its backlog is full
+            if (d->stats != nullptr)
+                d->stats->connectRetries.fetch_add(1, std::memory_order_relaxed);
+            d->backoff(attempt, msecs - time.elapsed());
+        }
+    }
+
+    quint64 flags = 0;
+    const QByteArray initMsg = initMessage(connectionType, flags);
+    if (!writeConfirmedMessage(static_cast<int>(msecs - time.elapsed()), initMsg, flags))
+        return false;
+
+    // Primaries without the extended protocol receive the payload as the
+    // first regular message
+    if (d->hasInitPayload && channel.isEmpty()) {
+        if (!(flags & SingleApplicationPrivate::InitPayloadFrame)
+            && !writeConfirmedMessage(static_cast<int>(msecs - time.elapsed()), d->initPayload))
+            return false;
+        d->hasInitPayload = false;
+    }
+
+    // A pipelined init message is only known to be accepted after its ack
+    if (!(d->options & SingleApplication::Mode::ExtendedProtocol)
+        || waitForAcks(static_cast<int>(msecs - time.elapsed()), 0))
+        return true;
+
+    // A restarted primary doesn't know the session and closes the connection,
+    // which slotSocketStateChanged() answers by forgetting the token
+    if (!(flags & SingleApplicationPrivate::ResumeFrame) || socket->state() == QLocalSocket::ConnectedState)
+        return false;
+    d->sessionToken = 0;
+    socket->abort();
+    return connectToPrimary(static_cast<int>(msecs - time.elapsed()), connectionType, retry);
+}
+
+bool PrimaryConnection::sendMessage(const QByteArray &message, int msecs, quint64 flags)
+{
+    sendError = SingleApplication::SendError::NoError;
+
+    bool ok = false;
+    if (hasAsyncMessages()) {
+        // Queue behind the asynchronous messages to retain their order
+        ok = waitForAsyncMessage(queueAsyncMessage(message, msecs, false, 0, flags), msecs);
+    } else {
+        // Make sure the socket is connected
+        ok = connectToPrimary(msecs, SingleApplicationPrivate::ConnectionType::Reconnect)
+            && writeConfirmedMessage(msecs, message, flags);
+    }
+
+    if (!ok && sendError == SingleApplication::SendError::NoError)
+        sendError = SingleApplication::SendError::TimeoutError;
+
+    return ok;
+}
+
+bool PrimaryConnection::writeConfirmedMessage(int msecs, const QByteArray &msg, quint64 flags)
+{
+    if (d->options & SingleApplication::Mode::ExtendedProtocol)
+        return writePipelinedMessage(msecs, msg, flags);
+
+    QElapsedTimer time;
+    time.start();
+
+    // Frame 1: The header indicates the message length that follows
+    if(!writeConfirmedFrame(static_cast<int>(msecs - time.elapsed()), SingleApplicationPrivate::frameHeader(msg.length(), 0)))
+        return false;
+
+    // Frame 2: The message
+    countSent(msg.length());
+    return writeConfirmedFrame(static_cast<int>(msecs - time.elapsed()), msg);
+}
+
+bool PrimaryConnection::writeConfirmedFrame(int msecs, const QByteArray &msg)
+{
+    socket->write(msg);
+    socket->flush();
+    expectAck(0, msg.length());
+
+    return waitForAcks(msecs, 0); // await ack byte
+}
+
+bool PrimaryConnection::writePipelinedMessage(int msecs, const QByteArray &msg, quint64 flags)
+{
+    QElapsedTimer time;
+    time.start();
+
+    QByteArray payload = msg;
+    d->compressMessage(payload, flags, credit);
+
+    // Wait for the primary to release room in the shared memory channel or
+    // its budget
+    while (true) {
+        const FrameResult result = writePipelinedFrame(payload, flags, 0);
+        if (result == FrameResult::Written)
+            break;
+        if (result == FrameResult::OverBudget) {
+            sendError = SingleApplication::SendError::OverBudgetError;
+            return false;
+        }
+        // Only an ack can release room, WouldBlock implies one is expected
+        if (awaitingAcks.isEmpty()
+            || !waitForAcks(static_cast<int>(msecs - time.elapsed()), static_cast<int>(awaitingAcks.size()) - 1)) {
+            sendError = SingleApplication::SendError::WouldBlockError;
+            return false;
+        }
+    }
+    socket->flush();
+
+    // Only block once the window of unacknowledged messages is full
+    if (!waitForAcks(static_cast<int>(msecs - time.elapsed()), SingleApplicationPrivate::MaxPendingAcks - 1)) {
+        sendError = SingleApplication::SendError::WouldBlockError;
+        return false;
+    }
+
+    return true;
+}
+
+PrimaryConnection::FrameResult PrimaryConnection::writePipelinedFrame(const QByteArray &msg, quint64 flags, quint64 messageId)
+{
+    // The budget of the primary is only known once the init message has been
+    // acknowledged, which is the frame in flight
+    if (credit < 0 && !awaitingAcks.isEmpty())
+        return FrameResult::WouldBlock;
+
+    // Channels can only be opened by the same user, a primary instance of
+    // another user couldn't attach to it
+    if ((flags & ~SingleApplicationPrivate::CompressedFrame) == 0 && d->sharedMemoryThreshold > 0
+        && (d->options & SingleApplication::Mode::User) && msg.length() >= d->sharedMemoryThreshold) {
+        switch (writeSharedMemoryFrame(msg, flags, messageId)) {
+        case DataChannelResult::Written:
+            countSent(msg.length());
+            return FrameResult::Written;
+        case DataChannelResult::Full:
+            return FrameResult::WouldBlock;
+        case DataChannelResult::Unavailable:
+            break;
+        }
+    }
+
+    // The primary buffers at most its budget, every ack hands the bytes of
+    // the acknowledged frame back. Messages it streams are passed on in
+    // chunks and only wait for the frames ahead of them.
+    const qint64 bytes = frameHeaderSize() + msg.length();
+    const bool streamed = streamingThreshold > 0 && channel.isEmpty() && flags == 0
+        && msg.length() >= streamingThreshold;
+    if (credit > 0) {
+        if (bytes > credit && !streamed)
+            return FrameResult::OverBudget;
+        if (bytesInFlight + qMin(bytes, credit) > credit)
+            return FrameResult::WouldBlock;
+    }
+
+    // Header and body go out back to back and are acknowledged by a single
+    // byte, which the primary coalesces with the acks of other messages.
+    writeFrameHeader(msg, SingleApplicationPrivate::PipelinedFrame | flags);
+    socket->write(msg);
+    expectAck(messageId, bytes);
+    countSent(msg.length());
+
+    return FrameResult::Written;
+}
+
+PrimaryConnection::DataChannelResult PrimaryConnection::writeSharedMemoryFrame(const QByteArray &msg, quint64 flags, quint64 messageId)
+{
+    const auto length = static_cast<quint64>(msg.length());
+
+    // (Re)create the channel if it can't hold the message, which is only safe
+    // once the primary instance consumed everything written to it.
+    if (dataMemory == nullptr || dataCapacity() < length) {
+        if (dataMemory != nullptr && !awaitingAcks.isEmpty())
+            return DataChannelResult::Full;
+        if (!createDataChannel(length))
+            return DataChannelResult::Unavailable;
+    }
+
+    // Once the primary consumed everything the ring starts over at its
+    // beginning. It doesn't store the tail again before the next message.
+    auto *header = static_cast<DataChannelHeader *>(dataMemory->data());
+    if (header->tail.load(std::memory_order_acquire) == dataHead) {
+        header->tail.store(0, std::memory_order_relaxed);
+        dataHead = 0;
+    }
+
+    // Messages are stored contiguously, skip the end of the ring if needed
+    const quint64 capacity = dataCapacity();
+    quint64 start = dataHead;
+    quint64 offset = start % capacity;
+    if (offset + length > capacity) {
+        start += capacity - offset;
+        offset = 0;
+    }
+
+    // Without a frame in flight no ack would announce room, the message takes
+    // the socket instead
+    if (start + length - header->tail.load(std::memory_order_acquire) > capacity)
+        return awaitingAcks.isEmpty() ? DataChannelResult::Unavailable : DataChannelResult::Full;
+
+    memcpy(static_cast<char *>(dataMemory->data()) + sizeof(DataChannelHeader) + offset, msg.constData(), length);
+    dataHead = start + length;
+
+    // Only the descriptor goes through the socket, the checksum of its frame
+    // doesn't cover the message
+    quint32 checksum = 0;
+    if (d->options & SingleApplication::Mode::Crc32cChecksums)
+        checksum = SingleApplicationPrivate::crc32c(msg.constData(), static_cast<size_t>(length));
+    QByteArray descriptor;
+    QDataStream descriptorStream(&descriptor, QIODevice::WriteOnly);
+    descriptorStream << dataMemory->key().toUtf8() << offset << length << dataHead << ++dataSequence << checksum;
+
+    writeFrameHeader(descriptor,
+                     SingleApplicationPrivate::PipelinedFrame | SingleApplicationPrivate::SharedMemoryFrame | flags);
+    socket->write(descriptor);
+    expectAck(messageId, frameHeaderSize() + descriptor.length());
+
+    return DataChannelResult::Written;
+}
+
+bool PrimaryConnection::createDataChannel(quint64 minimumCapacity)
+{
+    delete dataMemory;
+    dataMemory = nullptr;
+    dataHead = 0;
+    dataSequence = 0;
+
+    // Every connection of the pool has its own channel
+    const quint64 capacity = qMax<quint64>(SingleApplicationPrivate::MinimumDataChannelSize, minimumCapacity);
+    // QSharedMemory takes the size as an int on Qt 5
+    if (capacity > static_cast<quint64>(std::numeric_limits<int>::max()) - sizeof(DataChannelHeader))
+        return false;
+    const QString key = d->blockServerName + QStringLiteral("-data-%1-%2")
+                                                 .arg(QCoreApplication::applicationPid())
+                                                 .arg(++d->dataGeneration);
+
+    auto *channel = new QSharedMemory(key);
+    if (!channel->create(static_cast<int>(sizeof(DataChannelHeader) + capacity))) {
+        qWarning() << "SingleApplication: Unable to create the shared memory channel:" << channel->errorString();
+        delete channel;
+        return false;
+    }
+
+    auto *header = static_cast<DataChannelHeader *>(channel->data());
+    header->tail.store(0, std::memory_order_release);
+    dataMemory = channel;
+
+    return true;
+}
+
+quint64 PrimaryConnection::dataCapacity() const
+{
+    return static_cast<quint64>(dataMemory->size()) - sizeof(DataChannelHeader);
+}
+
+void PrimaryConnection::consumeAcks()
+{
+    if (socket->bytesAvailable() > 0)
+        incoming += socket->readAll();
+
+    // The primary answers with single byte acks, interleaved with records
+    // which carry a payload.
+    constexpr int recordHeader = 1 + static_cast<int>(sizeof(quint64));
+    QList<QByteArray> messages;
+    int pos = 0;
+    while (pos < incoming.size()) {
+        const char record = incoming.at(pos);
+        if (record == SingleApplicationPrivate::AckRecord) {
+            ++pos;
+            consumeAck();
+        } else if (record == SingleApplicationPrivate::SessionRecord) {
+            if (incoming.size() - pos < recordHeader)
+                break;
+            // Channel connections always start from scratch
+            if (channel.isEmpty())
+                d->sessionToken = qFromBigEndian<quint64>(incoming.constData() + pos + 1);
+            pos += recordHeader;
+        } else if (record == SingleApplicationPrivate::ProtocolRecord) {
+            if (incoming.size() - pos < 2)
+                break;
+            compactHeaders = static_cast<quint8>(incoming.at(pos + 1)) >= SingleApplicationPrivate::FrameVersion;
+            pos += 2;
+        } else if (record == SingleApplicationPrivate::CreditRecord) {
+            if (incoming.size() - pos < recordHeader + static_cast<int>(sizeof(quint64)))
+                break;
+            credit = static_cast<qint64>(qFromBigEndian<quint64>(incoming.constData() + pos + 1));
+            streamingThreshold = static_cast<qint64>(qFromBigEndian<quint64>(incoming.constData() + pos + recordHeader));
+            pos += recordHeader + static_cast<int>(sizeof(quint64));
+        } else if (record == SingleApplicationPrivate::MessageRecord) {
+            if (incoming.size() - pos < recordHeader)
+                break;
+            const quint64 length = qFromBigEndian<quint64>(incoming.constData() + pos + 1);
+            // A record the buffer could never hold would stall the connection
+            if (length > static_cast<quint64>(std::numeric_limits<int>::max() - recordHeader)) {
+                qWarning() << "SingleApplication: Oversized message record from the primary instance.";
+                incoming.clear();
+                socket->abort();
+                return;
+            }
+            if (static_cast<quint64>(incoming.size() - pos - recordHeader) < length)
+                break;
+            messages.append(incoming.mid(pos + recordHeader, static_cast<int>(length)));
+            pos += recordHeader + static_cast<int>(length);
+        } else {
+            qWarning() << "SingleApplication: Unexpected data from the primary instance.";
+            incoming.clear();
+            socket->abort();
+            return;
+        }
+    }
+    incoming.remove(0, pos);
+
+    // Emitted once the connection is consistent, the slots may send messages
+    for (QByteArray &message : messages)
+        Q_EMIT d->q_ptr->receivedMessage(0, std::move(message));
+}
+
+void PrimaryConnection::consumeAck()
+{
+    // The first ack of a resumed connection confirms the session
+    resuming = false;
+
+    // Primaries without a budget don't send a credit record before the ack
+    // of the init message
+    if (credit < 0)
+        credit = 0;
+
+    if (awaitingAcks.isEmpty())
+        return;
+
+    const PendingAck ack = awaitingAcks.takeFirst();
+    bytesInFlight -= ack.bytes;
+    if (d->stats != nullptr)
+        SingleApplicationPrivate::recordLatency(d->stats->ackLatency, d->statsClock.nsecsElapsed() - ack.written);
+
+    const quint64 messageId = ack.messageId;
+    if (messageId == 0)
+        return;
+
+    // Messages are acknowledged in the order they were written
+    for (auto it = asyncMessages.begin(); it != asyncMessages.end(); ++it) {
+        if (it->id == messageId) {
+            const AsyncMessage message = *it;
+            asyncMessages.erase(it);
+            finishAsyncMessage(message, true);
+            break;
+        }
+    }
+}
+
+void PrimaryConnection::expectAck(quint64 messageId, qint64 bytes)
+{
+    PendingAck ack;
+    ack.messageId = messageId;
+    ack.bytes = bytes;
+    if (d->stats != nullptr)
+        ack.written = d->statsClock.nsecsElapsed();
+    awaitingAcks.append(ack);
+    bytesInFlight += bytes;
+}
+
+qint64 PrimaryConnection::frameHeaderSize() const
+{
+    return compactHeaders ? static_cast<qint64>(sizeof(FrameHeader)) : static_cast<qint64>(sizeof(quint64));
+}
+
+void PrimaryConnection::writeFrameHeader(const QByteArray &body, quint64 flags)
+{
+    // Frames before the primary announced its header version use the header
+    // every version understands
+    if (!compactHeaders) {
+        socket->write(SingleApplicationPrivate::frameHeader(body.length(), flags));
+        return;
+    }
+
+    FrameHeader header = {};
+    header.magic = SingleApplicationPrivate::FrameMagic;
+    header.version = SingleApplicationPrivate::FrameVersion;
+    header.flags = static_cast<quint8>(flags >> 56);
+    if (d->options & SingleApplication::Mode::Crc32cChecksums) {
+        header.features = SingleApplicationPrivate::FrameChecksummed;
+        header.checksum = qToLittleEndian(SingleApplicationPrivate::crc32c(body.constData(), static_cast<size_t>(body.length())));
+    }
+    header.length = qToLittleEndian(static_cast<quint64>(body.length()));
+    header.sequence = qToLittleEndian(++frameSequence);
+    socket->write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+void PrimaryConnection::countSent(qint64 bytes)
+{
+    if (d->stats == nullptr)
+        return;
+
+    d->stats->messagesSent.fetch_add(1, std::memory_order_relaxed);
+    d->stats->bytesSent.fetch_add(static_cast<quint64>(bytes), std::memory_order_relaxed);
+}
+
+bool PrimaryConnection::waitForAcks(int msecs, int maxPending)
+{
+    QElapsedTimer time;
+    time.start();
+
+    consumeAcks();
+    while (awaitingAcks.size() > maxPending) {
+        const int remaining = static_cast<int>(msecs - time.elapsed());
+        if (remaining <= 0 || !socket->waitForReadyRead(remaining))
+            return false;
+        consumeAcks();
+    }
+
+    return true;
+}
+
+quint64 PrimaryConnection::queueAsyncMessage(const QByteArray &msg, int msecs, bool notify, quint64 messageId, quint64 flags)
+{
+    AsyncMessage message;
+    message.id = messageId != 0 ? messageId : ++d->lastMessageId;
+    message.payload = msg;
+    message.frameFlags = flags;
+    // Only the extended protocol can flag compressed frames
+    if (d->options & SingleApplication::Mode::ExtendedProtocol)
+        d->compressMessage(message.payload, message.frameFlags, credit);
+    message.deadline = QDeadlineTimer(msecs);
+    message.notify = notify;
+    message.blocking = !notify;
+    asyncMessages.append(message);
+
+    pumpAsyncMessages();
+
+    return message.id;
+}
+
+bool PrimaryConnection::waitForAsyncMessage(quint64 messageId, int msecs)
+{
+    QElapsedTimer time;
+    time.start();
+
+    const auto isQueued = [this, messageId](){
+        for (const AsyncMessage &message : std::as_const(asyncMessages)) {
+            if (message.id == messageId && !message.reported)
+                return true;
+        }
+        return false;
+    };
+
+    // Drive the socket with the blocking functions, which still emit the
+    // signals the asynchronous state machine reacts to.
+    int attempt = 0;
+    while (isQueued()) {
+        const int remaining = static_cast<int>(msecs - time.elapsed());
+        if (remaining <= 0) {
+            expireAsyncMessages(messageId);
+            break;
+        }
+
+        switch (socket->state()) {
+        case QLocalSocket::ConnectedState:
+            socket->waitForReadyRead(remaining);
+            break;
+        case QLocalSocket::ConnectingState:
+            socket->waitForConnected(remaining);
+            break;
+        case QLocalSocket::ClosingState:
+            socket->waitForDisconnected(remaining);
+            break;
+        default:
+            d->backoff(attempt, remaining);
+            pumpAsyncMessages();
+            break;
+        }
+    }
+
+    return blockingResults.take(messageId);
+}
+
+bool PrimaryConnection::flushMessages(int msecs)
+{
+    QElapsedTimer time;
+    time.start();
+
+    if (!asyncMessages.isEmpty())
+        waitForAsyncMessage(asyncMessages.constLast().id, msecs);
+
+    const bool ok = asyncMessages.isEmpty() && waitForAcks(static_cast<int>(msecs - time.elapsed()), 0)
+        && !lostFrames;
+
+    // Each loss is reported by a single flush
+    lostFrames = false;
+    return ok;
+}
+
+bool PrimaryConnection::hasAsyncMessages() const
+{
+    return asyncConnecting || !asyncMessages.isEmpty();
+}
+
+void PrimaryConnection::pumpAsyncMessages()
+{
+    expireAsyncMessages();
+
+    if (asyncMessages.isEmpty())
+        return;
+
+    if (socket->state() == QLocalSocket::UnconnectedState) {
+        open();
+        return;
+    }
+
+    if (socket->state() != QLocalSocket::ConnectedState)
+        return;
+
+    // The legacy protocol acknowledges every frame and can't have more than
+    // one of them in flight.
+    const bool pipelined = d->options & SingleApplication::Mode::ExtendedProtocol;
+    const int window = pipelined ? SingleApplicationPrivate::MaxPendingAcks : 1;
+
+    bool written = false;
+    QList<AsyncMessage> overBudget;
+    auto it = asyncMessages.begin();
+    while (it != asyncMessages.end() && awaitingAcks.size() < window) {
+        if (pipelined) {
+            if (it->framesWritten == 1) {
+                ++it;
+                continue;
+            }
+            // Resumed by the acks freeing room in the shared memory channel
+            // or the budget of the primary
+            const FrameResult result = writePipelinedFrame(it->payload, it->frameFlags, it->id);
+            if (result == FrameResult::WouldBlock)
+                break;
+            if (result == FrameResult::OverBudget) {
+                overBudget.append(*it);
+                it = asyncMessages.erase(it);
+                continue;
+            }
+            it->framesWritten = 1;
+        } else if (it->framesWritten == 0) {
+            socket->write(SingleApplicationPrivate::frameHeader(it->payload.length(), 0));
+            it->framesWritten = 1;
+            expectAck(0, static_cast<qint64>(sizeof(quint64)));
+        } else if (it->framesWritten == 1) {
+            socket->write(it->payload);
+            countSent(it->payload.length());
+            it->framesWritten = 2;
+            expectAck(it->id, it->payload.length());
+        } else {
+            ++it;
+            continue;
+        }
+        written = true;
+        ++it;
+    }
+
+    if (written)
+        socket->flush();
+
+    for (const AsyncMessage &message : std::as_const(overBudget)) {
+        qWarning() << "SingleApplication: Message" << message.id << "exceeds the budget of the primary instance.";
+        if (message.blocking)
+            sendError = SingleApplication::SendError::OverBudgetError;
+        finishAsyncMessage(message, false);
+    }
+}
+
+void PrimaryConnection::expireAsyncMessages(quint64 messageId)
+{
+    qint64 nextDeadline = -1;
+
+    for (auto it = asyncMessages.begin(); it != asyncMessages.end();) {
+        if (it->reported) {
+            ++it;
+            continue;
+        }
+
+        if (it->deadline.isForever()) {
+            ++it;
+            continue;
+        }
+
+        if (it->id != messageId && !it->deadline.hasExpired()) {
+            const qint64 remaining = it->deadline.remainingTime();
+            if (nextDeadline < 0 || remaining < nextDeadline)
+                nextDeadline = remaining;
+            ++it;
+            continue;
+        }
+
+        // A message which is partially on the wire has to be completed to
+        // keep the stream in sync, it is only reported as failed.
+        if (it->framesWritten == 0) {
+            const AsyncMessage message = *it;
+            it = asyncMessages.erase(it);
+            finishAsyncMessage(message, false);
+        } else {
+            finishAsyncMessage(*it, false);
+            it->reported = true;
+            ++it;
+        }
+    }
+
+    if (nextDeadline < 0) {
+        if (asyncTimer != nullptr)
+            asyncTimer->stop();
+        return;
+    }
+
+    if (asyncTimer == nullptr) {
+        asyncTimer = new QTimer(this);
+        asyncTimer->setSingleShot(true);
+        connect(asyncTimer, &QTimer::timeout, this, &PrimaryConnection::pumpAsyncMessages);
+    }
+    asyncTimer->start(static_cast<int>(nextDeadline));
+}
+
+void PrimaryConnection::finishAsyncMessage(const AsyncMessage &message, bool ok)
+{
+    if (message.reported)
+        return;
+
+    if (message.blocking)
+        blockingResults.insert(message.id, ok);
+
+    if (message.notify)
+        Q_EMIT d->q_ptr->messageDelivered(message.id, ok);
+}
+
+void PrimaryConnection::slotAcksAvailable()
+{
+    consumeAcks();
+    pumpAsyncMessages();
+}
+
+void PrimaryConnection::slotSocketStateChanged()
+{
+    if (socket->state() == QLocalSocket::ConnectedState) {
+        // Acknowledgements of a dropped connection will never arrive and its
+        // shared memory channel may never be consumed.
+        awaitingAcks.clear();
+        bytesInFlight = 0;
+        credit = -1;
+        streamingThreshold = 0;
+        compactHeaders = false;
+        frameSequence = 0;
+        incoming.clear();
+        delete dataMemory;
+        dataMemory = nullptr;
+
+        if (!asyncConnecting)
+            return;
+        asyncConnecting = false;
+        asyncAttempt = 0;
+
+        // The connection has to be initialised before any message
+        AsyncMessage init;
+        init.id = ++d->lastMessageId;
+        init.init = true;
+        init.payload = initMessage(SingleApplicationPrivate::ConnectionType::Reconnect, init.frameFlags);
+        init.deadline = QDeadlineTimer(QDeadlineTimer::Forever);
+
+        // Without the extended protocol the arguments follow as a message
+        if (d->hasInitPayload && channel.isEmpty()) {
+            if (!(init.frameFlags & SingleApplicationPrivate::InitPayloadFrame)) {
+                AsyncMessage payload;
+                payload.id = ++d->lastMessageId;
+                payload.init = true;
+                payload.payload = d->initPayload;
+                payload.deadline = QDeadlineTimer(QDeadlineTimer::Forever);
+                asyncMessages.prepend(payload);
+            }
+            d->hasInitPayload = false;
+        }
+        asyncMessages.prepend(init);
+
+        pumpAsyncMessages();
+        return;
+    }
+
+    if (socket->state() != QLocalSocket::UnconnectedState)
+        return;
+
+    // Acks which arrived before the connection dropped still count, the first
+    // one also tells whether the session has been accepted
+    consumeAcks();
+
+    asyncConnecting = false;
+    if (!awaitingAcks.isEmpty())
+        lostFrames = true;
+    awaitingAcks.clear();
+    bytesInFlight = 0;
+
+    // The session was rejected, the next attempt starts from scratch. The
+    // primary closed the connection before reading past the resume frame, so
+    // the messages behind it are sent again.
+    if (resuming) {
+        resuming = false;
+        d->sessionToken = 0;
+        for (auto it = asyncMessages.begin(); it != asyncMessages.end();) {
+            if (it->init || it->reported) {
+                it = asyncMessages.erase(it);
+                continue;
+            }
+            it->framesWritten = 0;
+            ++it;
+        }
+    }
+
+    // Messages which were on the wire may or may not have arrived
+    for (auto it = asyncMessages.begin(); it != asyncMessages.end();) {
+        if (it->framesWritten == 0) {
+            ++it;
+            continue;
+        }
+        const AsyncMessage message = *it;
+        it = asyncMessages.erase(it);
+        finishAsyncMessage(message, false);
+    }
+
+    // Reconnect to deliver the remaining messages as long as they are pending
+    if (!asyncMessages.isEmpty()) {
+        QTimer::singleShot(SingleApplicationPrivate::nextBackoff(asyncAttempt), this, &PrimaryConnection::pumpAsyncMessages);
+    }
+}
+
+void SingleApplicationPrivate::writeAck(ConnectionInfo &info)
+{
+    if (info.frameFlags & PipelinedFrame) {
+        ++info.pendingAcks;
+        return;
+    }
+
+    info.socket->putChar(AckRecord);
+}
+
+quint32 SingleApplicationPrivate::blockChecksum() const
+{
+    const auto *data = reinterpret_cast<const char *>(instancesInfo());
+    if (options & SingleApplication::Mode::Crc32cChecksums)
+        return crc32c(data, offsetof(InstancesInfo, checksum));
+
+#if (QT_VERSION >= QT_VERSION_CHECK(6, 0, 0))
+    quint16 checksum = qChecksum(QByteArrayView(data, offsetof(InstancesInfo, checksum)));
+#else
+    quint16 checksum = qChecksum(data, offsetof(InstancesInfo, checksum));
+#endif
+    return checksum;
+}
+
+quint32 SingleApplicationPrivate::storedBlockChecksum() const
+{
+    if (options & SingleApplication::Mode::Crc32cChecksums)
+        return static_cast<const Crc32cInstancesInfo *>(memory->constData())->checksum;
+
+    return instancesInfo()->checksum;
+}
+
+void SingleApplicationPrivate::writeBlockChecksum() const
+{
+    if (options & SingleApplication::Mode::Crc32cChecksums)
+        static_cast<Crc32cInstancesInfo *>(memory->data())->checksum = blockChecksum();
+    else
+        instancesInfo()->checksum = static_cast<quint16>(blockChecksum());
+}
+
+qint64 SingleApplicationPrivate::primaryPid() const
+{
+    if (isLockFree()) {
+        const quint32 pid = atomicInstances()->primaryPid.load(std::memory_order_acquire);
+        return pid != 0 ? static_cast<qint64>(pid) : -1;
+    }
+
+    qint64 pid;
+
+    memory->lock();
+    auto *inst = instancesInfo();
+    pid = inst->primaryPid;
+    memory->unlock();
+
+    return pid;
+}
+
+QString SingleApplicationPrivate::primaryUser() const
+{
+    if (isLockFree()) {
+        auto *inst = atomicInstances();
+        char username[sizeof(inst->primaryUser)];
+
+        // Retry while the primary instance is rewriting the name. The bound
+        // protects against a writer which died in the middle of the update.
+        for (int attempt = 0; attempt < MaximumSeqlockAttempts; ++attempt) {
+            const quint32 before = inst->sequence.load(std::memory_order_acquire);
+            memcpy(username, inst->primaryUser, sizeof(username));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            const quint32 after = inst->sequence.load(std::memory_order_relaxed);
+            if ((before & 1) == 0 && before == after) {
+                username[sizeof(username) - 1] = '\0';
+                return QString::fromUtf8(username);
+            }
+        }
+        return {};
+    }
+
+    QByteArray username;
+
+    memory->lock();
+    auto *inst = instancesInfo();
+    username = inst->primaryUser;
+    memory->unlock();
+
+    return QString::fromUtf8(username);
+}
+
+/**
+ * @brief Executed when a connection has been made to the LocalServer
+ */
+void SingleApplicationPrivate::slotConnectionEstablished()
+{
+    QLocalSocket *nextConnSocket = server->nextPendingConnection();
+
+    // The state is owned by the lambdas below and released together with
+    // their connections once the socket is destroyed.
+    const auto info = QSharedPointer<ConnectionInfo>::create();
+    info->socket = nextConnSocket;
+    if (receiveBudget > 0)
+        nextConnSocket->setReadBufferSize(receiveBudget);
+
+    QObject *context = ipcContext();
+
+    if (stats != nullptr) {
+        stats->connections.fetch_add(1, std::memory_order_relaxed);
+        connect(nextConnSocket, &QLocalSocket::destroyed, context, [this](){
+            stats->connections.fetch_sub(1, std::memory_order_relaxed);
+        });
+    }
+
+    connect(nextConnSocket, &QLocalSocket::aboutToClose, context, [info, this](){
+        slotClientConnectionClosed(*info);
+    });
+
+    connect(nextConnSocket, &QLocalSocket::disconnected, nextConnSocket, &QLocalSocket::deleteLater);
+
+    connect(nextConnSocket, &QLocalSocket::readyRead, context, [info, this](){
+        readFrames(*info);
+    });
+}
+
+void SingleApplicationPrivate::registerConnection(ConnectionInfo &info)
+{
+    // Legacy secondaries don't expect anything but acks, messages for an
+    // instance go through its default channel
+    if (!info.extended || !info.channel.isEmpty())
+        return;
+
+    const QWeakPointer<ConnectionInfo> connection = info.sharedFromThis();
+    instanceConnections.insert(info.instanceId, connection);
+    connect(info.socket, &QLocalSocket::destroyed, ipcContext(), [this, instanceId = info.instanceId, connection](){
+        instanceConnections.remove(instanceId, connection);
+    });
+}
+
+bool SingleApplicationPrivate::sendMessageToInstance(quint32 instanceId, const QByteArray &message)
+{
+    if (ipcThread != nullptr) {
+        IpcRequest request;
+        request.kind = IpcRequest::Kind::InstanceMessage;
+        request.messageId = instanceId;
+        request.message = message;
+        return submitRequest(request);
+    }
+
+    if (!isIpcThreadCaller("sendMessageToInstance()"))
+        return false;
+
+    return writeInstanceMessage(instanceId, message);
+}
+
+int SingleApplicationPrivate::broadcastMessage(const QByteArray &message)
+{
+    if (ipcThread != nullptr) {
+        IpcRequest request;
+        request.kind = IpcRequest::Kind::Broadcast;
+        request.message = message;
+        submitRequest(request);
+        return request.delivered;
+    }
+
+    if (!isIpcThreadCaller("broadcastMessage()"))
+        return 0;
+
+    return writeBroadcastMessage(message);
+}
+
+bool SingleApplicationPrivate::writeInstanceMessage(quint32 instanceId, const QByteArray &message)
+{
+    // Any connection of the instance will do
+    for (auto it = instanceConnections.constFind(instanceId); it != instanceConnections.constEnd() && it.key() == instanceId; ++it) {
+        const QSharedPointer<ConnectionInfo> connection = it.value().toStrongRef();
+        if (connection.isNull() || !connection->socket->isOpen())
+            continue;
+        queueMessageRecord(*connection, message);
+        return true;
+    }
+
+    return false;
+}
+
+int SingleApplicationPrivate::writeBroadcastMessage(const QByteArray &message)
+{
+    int delivered = 0;
+    const QList<quint32> instances = instanceConnections.uniqueKeys();
+    for (const quint32 instanceId : instances) {
+        if (writeInstanceMessage(instanceId, message))
+            ++delivered;
+    }
+
+    return delivered;
+}
+
+void SingleApplicationPrivate::queueMessageRecord(ConnectionInfo &info, const QByteArray &message)
+{
+    info.outgoing.append(MessageRecord);
+    info.outgoing.append(frameHeader(message.size(), 0));
+    info.outgoing.append(message);
+
+    if (info.flushScheduled)
+        return;
+    info.flushScheduled = true;
+
+    // Everything queued until the event loop gets to it is written at once
+    const QWeakPointer<ConnectionInfo> connection = info.sharedFromThis();
+    QTimer::singleShot(0, ipcContext(), [connection](){
+        const QSharedPointer<ConnectionInfo> info = connection.toStrongRef();
+        if (info.isNull())
+            return;
+        info->flushScheduled = false;
+        if (info->socket->isOpen())
+            info->socket->write(info->outgoing);
+        info->outgoing.clear();
+    });
+}
+
+/**
+ * @brief Consumes every complete frame buffered on the socket. Pipelined
+ * messages are acknowledged once per batch instead of once per frame.
+ */
+void SingleApplicationPrivate::readFrames(ConnectionInfo &info)
+{
+    bool progress = true;
+    while (progress) {
+        switch (static_cast<ConnectionStage>(info.stage)) {
+        case ConnectionStage::StageInitHeader:
+            progress = readMessageHeader(info, ConnectionStage::StageInitBody);
+            break;
+        case ConnectionStage::StageInitBody:
+            progress = readInitMessageBody(info);
+            break;
+        case ConnectionStage::StageConnectedHeader:
+            progress = readMessageHeader(info, ConnectionStage::StageConnectedBody);
+            break;
+        case ConnectionStage::StageConnectedBody:
+            progress = slotDataAvailable(info);
+            break;
+        case ConnectionStage::StageConnectedStream:
+            progress = readStreamChunk(info);
+            break;
+        default:
+            progress = false;
+            break;
+        };
+    }
+
+    if (info.pendingAcks > 0 && info.socket->isOpen()) {
+        info.socket->write(QByteArray(info.pendingAcks, AckRecord));
+        info.pendingAcks = 0;
+    }
+}
+
+bool SingleApplicationPrivate::readMessageHeader(ConnectionInfo &info, SingleApplicationPrivate::ConnectionStage nextStage)
+{
+    QLocalSocket *sock = info.socket;
+    char marker = 0;
+    if (!sock->isOpen() || sock->peek(&marker, 1) < 1)
+        return false;
+
+    // The header of the extended protocol is told apart by its first byte
+    const bool compact = (static_cast<quint8>(marker) & 0x01) != 0;
+    const qint64 headerSize = compact ? static_cast<qint64>(sizeof(FrameHeader)) : static_cast<qint64>(sizeof(quint64));
+    if (sock->bytesAvailable() < headerSize)
+        return false;
+
+    const bool connected = nextStage == ConnectionStage::StageConnectedBody;
+    if (connected && !acquireBudget(info))
+        return false;
+
+    // Read the header to know the message length
+    quint64 msgLen = 0;
+    if (compact) {
+        FrameHeader header;
+        sock->read(reinterpret_cast<char *>(&header), sizeof(header));
+        if (header.magic != FrameMagic || header.version != FrameVersion
+            || qFromLittleEndian(header.sequence) != ++info.frameSequence) {
+            qWarning() << "SingleApplication: Invalid frame header from instance" << info.instanceId;
+            sock->close();
+            return false;
+        }
+        msgLen = (static_cast<quint64>(header.flags) << 56) | (qFromLittleEndian(header.length) & ~FrameFlagsMask);
+        info.frameChecksummed = (header.features & FrameChecksummed) != 0;
+        info.frameChecksum = qFromLittleEndian(header.checksum);
+    } else {
+        info.frameChecksummed = false;
+        uchar header[sizeof(quint64)];
+        sock->read(reinterpret_cast<char *>(header), sizeof(header));
+        msgLen = qFromBigEndian<quint64>(header);
+    }
+    info.stage = static_cast<quint8>(nextStage);
+    info.frameFlags = msgLen & FrameFlagsMask;
+    info.msgLen = static_cast<qint64>(msgLen & ~FrameFlagsMask);
+
+    // Plain messages can be passed on before they have been received in full
+    const bool streamed = connected && streamingThreshold > 0 && info.channel.isEmpty()
+        && info.msgLen >= streamingThreshold && (info.frameFlags & ~PipelinedFrame) == 0;
+
+    // The socket doesn't buffer more than the budget, so a larger frame would
+    // never be complete.
+    if (!streamed && receiveBudget > 0 && info.msgLen > receiveBudget - headerSize) {
+        qWarning() << "SingleApplication: Message of" << info.msgLen << "bytes from instance"
+                   << info.instanceId << "exceeds the receive budget.";
+        sock->close();
+        return false;
+    }
+
+    if (connected && !streamed) {
+        info.budgeted = info.msgLen;
+        bufferedBytes += info.msgLen;
+    }
+
+    // Pipelined senders don't wait for the header to be acknowledged
+    if (!(info.frameFlags & PipelinedFrame))
+        writeAck(info);
+
+    if (stats != nullptr)
+        info.frameStart = statsClock.nsecsElapsed();
+
+    if (streamed)
+        startStream(info);
+
+    return true;
+}
+
+bool SingleApplicationPrivate::acquireBudget(ConnectionInfo &info)
+{
+    if (totalReceiveBudget <= 0 || bufferedBytes < totalReceiveBudget)
+        return true;
+
+    // Resumed once the messages in progress on other connections completed.
+    // Until then the socket stops draining the kernel buffer.
+    if (!info.paused) {
+        info.paused = true;
+        info.socket->setReadBufferSize(PausedReadBufferSize);
+        pausedConnections.append(info.sharedFromThis());
+    }
+
+    return false;
+}
+
+void SingleApplicationPrivate::releaseBudget(ConnectionInfo &info, qint64 bytes)
+{
+    if (bytes <= 0)
+        return;
+
+    info.budgeted -= bytes;
+    bufferedBytes -= bytes;
+
+    if (pausedConnections.isEmpty() || resumeScheduled || bufferedBytes >= totalReceiveBudget)
+        return;
+
+    // Not from within readFrames() of another connection
+    resumeScheduled = true;
+    QTimer::singleShot(0, ipcContext(), [this](){
+        resumeConnections();
+    });
+}
+
+void SingleApplicationPrivate::resumeConnections()
+{
+    resumeScheduled = false;
+
+    QList<QWeakPointer<ConnectionInfo>> paused;
+    paused.swap(pausedConnections);
+
+    for (const QWeakPointer<ConnectionInfo> &connection : std::as_const(paused)) {
+        const QSharedPointer<ConnectionInfo> info = connection.toStrongRef();
+        if (info.isNull())
+            continue;
+        info->paused = false;
+        info->socket->setReadBufferSize(receiveBudget);
+        readFrames(*info);
+    }
+}
+
+bool SingleApplicationPrivate::isFrameComplete(const ConnectionInfo &info)
+{
+    if (!info.socket->isOpen()) {
+        return false;
+    }
+
+    if (info.socket->bytesAvailable() < static_cast<qint64>(info.msgLen)) {
+        return false;
+    }
+
+    return true;
+}
+
+bool SingleApplicationPrivate::readInitMessageBody(ConnectionInfo &info)
+{
+    if(!isFrameComplete(info))
+        return false;
+
+    // Read the message body. Only the current frame, more may be pipelined.
+    if (info.frameFlags & ResumeFrame)
+        return readResumeMessageBody(info);
+
+    QLocalSocket *sock = info.socket;
+    QByteArray msgBytes = sock->read(info.msgLen);
+    QDataStream readStream(msgBytes);
+
+    // server name
+    QByteArray latin1Name;
+    readStream >> latin1Name;
+
+    // connection type
+    ConnectionType connectionType = ConnectionType::InvalidConnection;
+    quint8 connTypeVal = static_cast<quint8>(ConnectionType::InvalidConnection);
+    readStream >> connTypeVal;
+    connectionType = static_cast<ConnectionType>(connTypeVal);
+
+    // instance id
+    quint32 instanceId = 0;
+    readStream >> instanceId;
+
+    // checksum, covering everything before it
+    const auto checksummed = static_cast<quint32>(readStream.device()->pos());
+    quint16 msgChecksum = 0;
+    readStream >> msgChecksum;
+
+#if (QT_VERSION >= QT_VERSION_CHECK(6, 0, 0))
+    const quint16 actualChecksum = qChecksum(QByteArrayView(msgBytes.constData(), checksummed));
+#else
+    const quint16 actualChecksum = qChecksum(msgBytes.constData(), checksummed);
+#endif
+
+    // first message of the instance
+    QByteArray payload;
+    if (info.frameFlags & InitPayloadFrame)
+        readStream >> payload;
+
+    // channel of the connection
+    QByteArray channel;
+    if (info.frameFlags & ChannelFrame)
+        readStream >> channel;
+
+    bool isValid = readStream.status() == QDataStream::Ok && QLatin1String(latin1Name) == blockServerName && msgChecksum == actualChecksum;
+
+    if (!isValid) {
+        sock->close();
+        return false;
+    }
+
+    info.instanceId = instanceId;
+    info.channel = QString::fromUtf8(channel);
+    info.stage = static_cast<quint8>(ConnectionStage::StageConnectedHeader);
+
+    if (connectionType == ConnectionType::NewInstance
+        || (connectionType == ConnectionType::SecondaryInstance
+            && options & SingleApplication::Mode::SecondaryNotification)) {
+        emitInstanceStarted();
+    }
+
+    if (info.frameFlags & InitPayloadFrame && sock->isOpen()) {
+        countReceived(info, 1, payload.size());
+        emitReceivedMessage(instanceId, std::move(payload));
+    }
+
+    // The slot may have closed the connection
+    if (!sock->isOpen())
+        return false;
+
+    // Pipelining secondaries may resume the session of their default channel
+    // after a reconnect
+    info.extended = (info.frameFlags & PipelinedFrame) != 0;
+    if (info.extended) {
+        if (info.channel.isEmpty())
+            writeSessionToken(info);
+        writeCredit(info);
+        writeProtocolVersion(info);
+    }
+    registerConnection(info);
+
+    writeAck(info);
+
+    return true;
+}
+
+bool SingleApplicationPrivate::readResumeMessageBody(ConnectionInfo &info)
+{
+    QLocalSocket *sock = info.socket;
+    QByteArray msgBytes = sock->read(info.msgLen);
+    QDataStream readStream(msgBytes);
+
+    quint64 token = 0;
+    readStream >> token;
+
+    // Unknown tokens are rejected, the secondary instance then falls back to
+    // a regular init message.
+    const auto session = sessions.constFind(token);
+    if (readStream.status() != QDataStream::Ok || token == 0 || session == sessions.constEnd()) {
+        sock->close();
+        return false;
+    }
+
+    info.instanceId = *session;
+    info.stage = static_cast<quint8>(ConnectionStage::StageConnectedHeader);
+    info.extended = true;
+    writeCredit(info);
+    writeProtocolVersion(info);
+    registerConnection(info);
+    writeAck(info);
+
+    return true;
+}
+
+void SingleApplicationPrivate::writeSessionToken(ConnectionInfo &info)
+{
+    // Forgetting sessions only costs the affected secondaries a full init
+    if (sessions.size() >= MaximumSessions)
+        sessions.clear();
+
+    quint64 token = 0;
+    while (token == 0 || sessions.contains(token)) {
+#if (QT_VERSION >= QT_VERSION_CHECK(5, 10, 0))
+        token = QRandomGenerator::system()->generate64();
+#else
+        qsrand(QDateTime::currentMSecsSinceEpoch() % std::numeric_limits<uint>::max());
+        token = (static_cast<quint64>(qrand()) << 32) ^ static_cast<quint64>(qrand());
+#endif
+    }
+    sessions.insert(token, info.instanceId);
+
+    QByteArray record(1, SessionRecord);
+    QDataStream recordStream(&record, QIODevice::WriteOnly | QIODevice::Append);
+    recordStream << token;
+    info.socket->write(record);
+}
+
+void SingleApplicationPrivate::writeCredit(ConnectionInfo &info)
+{
+    // Secondaries never have more bytes in flight than the primary buffers
+    if (receiveBudget <= 0)
+        return;
+
+    QByteArray record(1, CreditRecord);
+    QDataStream recordStream(&record, QIODevice::WriteOnly | QIODevice::Append);
+    recordStream << static_cast<quint64>(receiveBudget) << static_cast<quint64>(streamingThreshold);
+    info.socket->write(record);
+}
+
+void SingleApplicationPrivate::writeProtocolVersion(ConnectionInfo &info)
+{
+    // The secondary switches to the fixed layout header from its next frame
+    const char record[] = { ProtocolRecord, static_cast<char>(FrameVersion) };
+    info.socket->write(record, sizeof(record));
+}
+
+bool SingleApplicationPrivate::slotDataAvailable(ConnectionInfo &info)
+{
+    if (!isFrameComplete(info))
+        return false;
+
+    QLocalSocket *dataSocket = info.socket;
+    const quint32 instanceId = info.instanceId;
+    info.stage = static_cast<quint8>(ConnectionStage::StageConnectedHeader);
+    QByteArray message = readFrameBody(info);
+    releaseBudget(info, info.budgeted);
+
+    if (info.frameChecksummed && crc32c(message.constData(), static_cast<size_t>(message.size())) != info.frameChecksum) {
+        qWarning() << "SingleApplication: Corrupted message from instance" << instanceId;
+        dataSocket->close();
+        return false;
+    }
+
+    quint64 dataTail = 0;
+    if (info.frameFlags & SharedMemoryFrame) {
+        if (!readSharedMemoryFrame(info, message, dataTail)) {
+            qWarning() << "SingleApplication: Invalid or corrupted shared memory message from instance" << instanceId;
+            dataSocket->close();
+            return false;
+        }
+    }
+    const QSharedPointer<QSharedMemory> dataMemory = info.dataMemory;
+
+    if (info.frameFlags & CompressedFrame) {
+        // qUncompress() allocates the size the sender put in front
+        const qint64 inflated = message.size() >= 4 ? qFromBigEndian<quint32>(message.constData()) : -1;
+        if (inflated < 0 || inflated > maximumInflatedSize(receiveBudget)
+            || (totalReceiveBudget > 0 && inflated > totalReceiveBudget)) {
+            qWarning() << "SingleApplication: Invalid compressed message from instance" << instanceId;
+            dataSocket->close();
+            return false;
+        }
+        message = qUncompress(message);
+        if (message.isEmpty()) {
+            qWarning() << "SingleApplication: Invalid compressed message from instance" << instanceId;
+            dataSocket->close();
+            return false;
+        }
+    }
+
+    QList<QByteArray> messages;
+    if (info.frameFlags & BatchFrame) {
+        // Every message takes at least its length, a count the frame can't
+        // hold would make the list reserve memory for nothing
+        const quint64 maxCount = static_cast<quint64>(qMax(message.size() - 4, 0)) / sizeof(quint32);
+        const bool validCount = message.size() >= 4 && qFromBigEndian<quint32>(message.constData()) <= maxCount;
+        QDataStream batchStream(message);
+        if (validCount)
+            batchStream >> messages;
+        if (!validCount || batchStream.status() != QDataStream::Ok) {
+            qWarning() << "SingleApplication: Invalid message batch from instance" << instanceId;
+            dataSocket->close();
+            return false;
+        }
+    }
+
+    writeAck(info);
+
+    if (stats != nullptr) {
+        recordLatency(stats->frameLatency, statsClock.nsecsElapsed() - info.frameStart);
+        if (info.frameFlags & BatchFrame) {
+            qint64 bytes = 0;
+            for (const QByteArray &batchMessage : std::as_const(messages))
+                bytes += batchMessage.size();
+            countReceived(info, messages.size(), bytes);
+        } else {
+            countReceived(info, 1, message.size());
+        }
+    }
+
+    if (!info.channel.isEmpty()) {
+        const QString channel = info.channel;
+        if (info.frameFlags & BatchFrame) {
+            for (QByteArray &batchMessage : messages)
+                emitChannelMessage(instanceId, channel, std::move(batchMessage));
+        } else {
+            emitChannelMessage(instanceId, channel, std::move(message));
+        }
+    } else if (info.frameFlags & BatchFrame) {
+        emitReceivedMessages(instanceId, std::move(messages));
+    } else {
+        emitReceivedMessage(instanceId, std::move(message));
+    }
+
+    // Hand the room back to the sender only once the slots are done with it
+    if (dataTail != 0) {
+        auto *header = static_cast<DataChannelHeader *>(dataMemory->data());
+        header->tail.store(dataTail, std::memory_order_release);
+    }
+
+    return true;
+}
+
+void SingleApplicationPrivate::emitInstanceStarted()
+{
+    Q_Q(SingleApplication);
+
+    if (ipcWorker == nullptr) {
+        Q_EMIT q->instanceStarted();
+        return;
+    }
+
+    ReceivedEvent event;
+    event.kind = ReceivedEvent::Kind::InstanceStarted;
+    postReceivedEvent(std::move(event));
+}
+
+void SingleApplicationPrivate::emitReceivedMessage(quint32 instanceId, QByteArray &&message)
+{
+    Q_Q(SingleApplication);
+
+    if (ipcWorker == nullptr) {
+        if (!isCoalescing())
+            Q_EMIT q->receivedMessage(instanceId, std::move(message));
+        else if (options & SingleApplication::Mode::MessageViews)
+            coalesceMessage(instanceId, QByteArray(message.constData(), message.size()));
+        else
+            coalesceMessage(instanceId, std::move(message));
+        return;
+    }
+
+    // Views of the connection buffer or a shared memory channel don't
+    // outlive this call
+    ReceivedEvent event;
+    event.instanceId = instanceId;
+    if (options & SingleApplication::Mode::MessageViews)
+        event.message = QByteArray(message.constData(), message.size());
+    else
+        event.message = std::move(message);
+    postReceivedEvent(std::move(event));
+}
+
+void SingleApplicationPrivate::emitReceivedMessages(quint32 instanceId, QList<QByteArray> &&messages)
+{
+    if (ipcWorker != nullptr) {
+        ReceivedEvent event;
+        event.instanceId = instanceId;
+        event.messages = std::move(messages);
+        event.kind = ReceivedEvent::Kind::Batch;
+        postReceivedEvent(std::move(event));
+        return;
+    }
+
+    deliverMessages(instanceId, std::move(messages));
+}
+
+void SingleApplicationPrivate::emitChannelMessage(quint32 instanceId, const QString &channel, QByteArray &&message)
+{
+    Q_Q(SingleApplication);
+
+    if (ipcWorker == nullptr) {
+        Q_EMIT q->receivedChannelMessage(instanceId, channel, std::move(message));
+        return;
+    }
+
+    ReceivedEvent event;
+    event.kind = ReceivedEvent::Kind::ChannelMessage;
+    event.instanceId = instanceId;
+    event.channel = channel;
+    if (options & SingleApplication::Mode::MessageViews)
+        event.message = QByteArray(message.constData(), message.size());
+    else
+        event.message = std::move(message);
+    postReceivedEvent(std::move(event));
+}
+
+void SingleApplicationPrivate::deliverMessages(quint32 instanceId, QList<QByteArray> &&messages)
+{
+    Q_Q(SingleApplication);
+
+    if (isCoalescing()) {
+        for (QByteArray &message : messages)
+            coalesceMessage(instanceId, std::move(message));
+        return;
+    }
+
+    // Applications which only handle single messages still get every one
+    static const QMetaMethod batchSignal = QMetaMethod::fromSignal(&SingleApplication::receivedMessages);
+    if (q->isSignalConnected(batchSignal)) {
+        Q_EMIT q->receivedMessages(instanceId, std::move(messages));
+        return;
+    }
+
+    for (QByteArray &message : messages)
+        Q_EMIT q->receivedMessage(instanceId, std::move(message));
+}
+
+void SingleApplicationPrivate::setCoalescingWindow(int msecs, int maxMessages)
+{
+    coalesceWindow = qMax(0, msecs);
+    coalesceCount = qMax(0, maxMessages);
+
+    if (coalesceWindow == 0 && coalesceCount == 0) {
+        flushCoalescedMessages();
+        delete coalesceTimer;
+        coalesceTimer = nullptr;
+        return;
+    }
+
+    if (coalesceTimer == nullptr) {
+        coalesceTimer = new QTimer(this);
+        coalesceTimer->setSingleShot(true);
+        connect(coalesceTimer, &QTimer::timeout, this, [this](){
+            flushCoalescedMessages();
+        });
+    }
+}
+
+bool SingleApplicationPrivate::isCoalescing() const
+{
+    if (coalesceTimer == nullptr)
+        return false;
+
+    static const QMetaMethod batchSignal = QMetaMethod::fromSignal(&SingleApplication::receivedMessageBatch);
+    return q_ptr->isSignalConnected(batchSignal);
+}
+
+void SingleApplicationPrivate::coalesceMessage(quint32 instanceId, QByteArray &&message)
+{
+    coalescedMessages.append(qMakePair(instanceId, std::move(message)));
+
+    if (coalesceCount > 0 && coalescedMessages.size() >= coalesceCount) {
+        flushCoalescedMessages();
+        return;
+    }
+
+    // The window starts with the first message of a batch
+    if (!coalesceTimer->isActive())
+        coalesceTimer->start(coalesceWindow);
+}
+
+void SingleApplicationPrivate::flushCoalescedMessages()
+{
+    Q_Q(SingleApplication);
+
+    if (coalesceTimer != nullptr)
+        coalesceTimer->stop();
+    if (coalescedMessages.isEmpty())
+        return;
+
+    QList<QPair<quint32, QByteArray>> messages;
+    messages.swap(coalescedMessages);
+    Q_EMIT q->receivedMessageBatch(std::move(messages));
+}
+
+void SingleApplicationPrivate::postReceivedEvent(ReceivedEvent &&event)
+{
+    bool wake = false;
+    {
+        QMutexLocker locker(&receivedMutex);
+        wake = receivedEvents.isEmpty();
+        receivedEvents.append(std::move(event));
+    }
+
+    // Everything received until the main thread gets to it forms one batch
+    if (wake)
+        QMetaObject::invokeMethod(this, "deliverReceivedEvents", Qt::QueuedConnection);
+}
+
+void SingleApplicationPrivate::deliverReceivedEvents()
+{
+    QList<ReceivedEvent> events;
+    {
+        QMutexLocker locker(&receivedMutex);
+        events.swap(receivedEvents);
+    }
+
+    for (ReceivedEvent &event : events)
+        deliverReceivedEvent(event);
+}
+
+void SingleApplicationPrivate::deliverReceivedEvent(ReceivedEvent &event)
+{
+    Q_Q(SingleApplication);
+
+    switch (event.kind) {
+    case ReceivedEvent::Kind::Message:
+        if (isCoalescing())
+            coalesceMessage(event.instanceId, std::move(event.message));
+        else
+            Q_EMIT q->receivedMessage(event.instanceId, std::move(event.message));
+        break;
+    case ReceivedEvent::Kind::Batch:
+        deliverMessages(event.instanceId, std::move(event.messages));
+        break;
+    case ReceivedEvent::Kind::InstanceStarted:
+        Q_EMIT q->instanceStarted();
+        break;
+    case ReceivedEvent::Kind::StreamStarted:
+        Q_EMIT q->messageStarted(event.instanceId, event.streamId, event.streamLength);
+        break;
+    case ReceivedEvent::Kind::StreamChunk:
+        Q_EMIT q->messageChunk(event.streamId, event.message);
+        break;
+    case ReceivedEvent::Kind::StreamFinished:
+        Q_EMIT q->messageFinished(event.streamId, event.complete);
+        break;
+    case ReceivedEvent::Kind::ChannelMessage:
+        Q_EMIT q->receivedChannelMessage(event.instanceId, event.channel, std::move(event.message));
+        break;
+    }
+}
+
+void SingleApplicationPrivate::startStream(ConnectionInfo &info)
+{
+    info.stage = static_cast<quint8>(ConnectionStage::StageConnectedStream);
+    info.streamId = ++lastStreamId;
+    info.streamChecksum = 0;
+
+    // The socket mustn't buffer the message in full either
+    if (receiveBudget <= 0 || receiveBudget > MaximumStreamChunk)
+        info.socket->setReadBufferSize(MaximumStreamChunk);
+
+    ReceivedEvent event;
+    event.kind = ReceivedEvent::Kind::StreamStarted;
+    event.instanceId = info.instanceId;
+    event.streamId = info.streamId;
+    event.streamLength = info.msgLen;
+    emitStreamEvent(std::move(event));
+}
+
+bool SingleApplicationPrivate::readStreamChunk(ConnectionInfo &info)
+{
+    QLocalSocket *sock = info.socket;
+    if (!sock->isOpen())
+        return false;
+
+    // info.msgLen counts the bytes of the message which are still to come
+    const qint64 length = qMin(qMin(sock->bytesAvailable(), info.msgLen), MaximumStreamChunk);
+    if (length <= 0)
+        return false;
+
+    // Chunks are read into the per connection buffer, which together with the
+    // socket's read buffer stays bounded by the chunk size no matter how large
+    // the message is.
+    if (info.buffer.size() < length)
+        info.buffer.resize(length);
+    sock->read(info.buffer.data(), length);
+    info.msgLen -= length;
+    if (info.frameChecksummed)
+        info.streamChecksum = crc32c(info.buffer.constData(), static_cast<size_t>(length), info.streamChecksum);
+    countReceived(info, info.msgLen > 0 ? 0 : 1, length);
+
+    ReceivedEvent chunk;
+    chunk.kind = ReceivedEvent::Kind::StreamChunk;
+    chunk.streamId = info.streamId;
+    chunk.message = QByteArray::fromRawData(info.buffer.constData(), length);
+    emitStreamEvent(std::move(chunk));
+
+    if (info.msgLen > 0)
+        return true;
+
+    info.stage = static_cast<quint8>(ConnectionStage::StageConnectedHeader);
+    sock->setReadBufferSize(qMax<qint64>(receiveBudget, 0));
+    writeAck(info);
+    if (stats != nullptr)
+        recordLatency(stats->frameLatency, statsClock.nsecsElapsed() - info.frameStart);
+
+    ReceivedEvent finished;
+    finished.kind = ReceivedEvent::Kind::StreamFinished;
+    finished.streamId = info.streamId;
+    // The chunks were delivered already, a mismatch only marks them incomplete
+    finished.complete = !info.frameChecksummed || info.streamChecksum == info.frameChecksum;
+    emitStreamEvent(std::move(finished));
+
+    return true;
+}
+
+void SingleApplicationPrivate::emitStreamEvent(ReceivedEvent &&event)
+{
+    if (ipcWorker == nullptr) {
+        deliverReceivedEvent(event);
+        return;
+    }
+
+    // Chunks are views of the connection buffer and don't outlive this call
+    if (event.kind == ReceivedEvent::Kind::StreamChunk)
+        event.message = QByteArray(event.message.constData(), event.message.size());
+    postReceivedEvent(std::move(event));
+}
+
+bool SingleApplicationPrivate::readSharedMemoryFrame(ConnectionInfo &info, QByteArray &message, quint64 &dataTail) const
+{
+    QDataStream descriptorStream(message);
+
+    QByteArray key;
+    quint64 offset = 0;
+    quint64 length = 0;
+    quint64 end = 0;
+    quint64 sequence = 0;
+    quint32 checksum = 0;
+    descriptorStream >> key >> offset >> length >> end >> sequence >> checksum;
+    if (descriptorStream.status() != QDataStream::Ok)
+        return false;
+
+    // The sender replaces its channel when it needs a larger one
+    if (info.dataMemory.isNull() || info.dataMemory->key() != QString::fromUtf8(key)) {
+        // Only channels derived from the name of this application are accepted
+        if (!key.startsWith(blockServerName.toUtf8()))
+            return false;
+        info.dataMemory.reset(new QSharedMemory(QString::fromUtf8(key)));
+        if (!info.dataMemory->attach()) {
+            info.dataMemory.reset();
+            return false;
+        }
+        info.dataSequence = 0;
+    }
+
+    const auto capacity = static_cast<quint64>(info.dataMemory->size()) - sizeof(DataChannelHeader);
+    if (sequence != info.dataSequence + 1 || offset > capacity || length > capacity - offset || end == 0)
+        return false;
+    info.dataSequence = sequence;
+
+    const char *data = static_cast<const char *>(info.dataMemory->constData()) + sizeof(DataChannelHeader) + offset;
+    if (info.frameChecksummed && crc32c(data, static_cast<size_t>(length)) != checksum)
+        return false;
+    if (options & SingleApplication::Mode::MessageViews) {
+        message = QByteArray::fromRawData(data, static_cast<int>(length));
+    } else {
+        message = QByteArray(data, static_cast<int>(length));
+    }
+    dataTail = end;
+
+    return true;
+}
+
+qint64 SingleApplicationPrivate::maximumInflatedSize(qint64 budget)
+{
+    return budget > 0 ? budget : MaximumStreamChunk;
+}
+
+void SingleApplicationPrivate::compressMessage(QByteArray &message, quint64 &flags, qint64 budget) const
+{
+    // The primary refuses to inflate messages beyond the budget
+    if (compressionThreshold <= 0 || message.length() < compressionThreshold
+        || message.length() > maximumInflatedSize(budget))
+        return;
+
+    // Favour speed, large payloads are usually repetitive enough anyway
+    QByteArray compressed = qCompress(message, 1);
+    if (compressed.length() >= message.length())
+        return;
+
+    message = std::move(compressed);
+    flags |= CompressedFrame;
+}
+
+QByteArray SingleApplicationPrivate::readFrameBody(ConnectionInfo &info) const
+{
+    QLocalSocket *sock = info.socket;
+
+    // Read exactly the current frame straight into its final storage, more
+    // frames may follow in the socket buffer.
+    if (!(options & SingleApplication::Mode::MessageViews)) {
+        QByteArray message;
+        message.resize(info.msgLen);
+        sock->read(message.data(), info.msgLen);
+        return message;
+    }
+
+    // The per connection buffer only grows, so a stream of messages of
+    // similar sizes is received without any allocation.
+    if (info.buffer.size() < info.msgLen)
+        info.buffer.resize(info.msgLen);
+    sock->read(info.buffer.data(), info.msgLen);
+
+    return QByteArray::fromRawData(info.buffer.constData(), info.msgLen);
+}
+
+void SingleApplicationPrivate::slotClientConnectionClosed(ConnectionInfo &info)
+{
+    if (info.socket->bytesAvailable() > 0)
+        readFrames(info);
+
+    // The rest of the message won't arrive anymore
+    releaseBudget(info, info.budgeted);
+
+    if (info.stage == static_cast<quint8>(ConnectionStage::StageConnectedStream)) {
+        info.stage = static_cast<quint8>(ConnectionStage::StageConnectedHeader);
+
+        ReceivedEvent finished;
+        finished.kind = ReceivedEvent::Kind::StreamFinished;
+        finished.streamId = info.streamId;
+        emitStreamEvent(std::move(finished));
+    }
+}
+
+void SingleApplicationPrivate::recordLatency(std::atomic<quint64> *histogram, qint64 nsecs)
+{
+    // Bucket n holds latencies below 2^n microseconds
+    const auto usecs = static_cast<quint64>(qMax<qint64>(0, nsecs) / 1000);
+    const int bucket = usecs == 0 ? 0 : 64 - static_cast<int>(qCountLeadingZeroBits(usecs));
+    histogram[qMin(bucket, SingleApplication::IpcStats::HistogramBuckets - 1)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void SingleApplicationPrivate::countReceived(ConnectionInfo &info, quint64 messages, quint64 bytes)
+{
+    if (stats == nullptr)
+        return;
+
+    // Counters outlive the connections so instances which reconnect keep them
+    if (info.counters.isNull()) {
+        QMutexLocker locker(&statsMutex);
+        QSharedPointer<InstanceCounters> &counters = instanceCounters[info.instanceId];
+        if (counters.isNull())
+            counters = QSharedPointer<InstanceCounters>::create();
+        info.counters = counters;
+    }
+
+    stats->messagesReceived.fetch_add(messages, std::memory_order_relaxed);
+    stats->bytesReceived.fetch_add(bytes, std::memory_order_relaxed);
+    info.counters->messagesReceived.fetch_add(messages, std::memory_order_relaxed);
+    info.counters->bytesReceived.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+SingleApplication::IpcStats SingleApplicationPrivate::ipcStats() const
+{
+    SingleApplication::IpcStats result;
+    if (stats == nullptr)
+        return result;
+
+    result.messagesSent = stats->messagesSent.load(std::memory_order_relaxed);
+    result.bytesSent = stats->bytesSent.load(std::memory_order_relaxed);
+    result.messagesReceived = stats->messagesReceived.load(std::memory_order_relaxed);
+    result.bytesReceived = stats->bytesReceived.load(std::memory_order_relaxed);
+    result.connectRetries = stats->connectRetries.load(std::memory_order_relaxed);
+    result.connections = stats->connections.load(std::memory_order_relaxed);
+
+    result.ackLatency.reserve(SingleApplication::IpcStats::HistogramBuckets);
+    result.frameLatency.reserve(SingleApplication::IpcStats::HistogramBuckets);
+    for (int i = 0; i < SingleApplication::IpcStats::HistogramBuckets; ++i) {
+        result.ackLatency.append(stats->ackLatency[i].load(std::memory_order_relaxed));
+        result.frameLatency.append(stats->frameLatency[i].load(std::memory_order_relaxed));
+    }
+
+    QMutexLocker locker(&statsMutex);
+    for (auto it = instanceCounters.constBegin(); it != instanceCounters.constEnd(); ++it) {
+        SingleApplication::IpcStats::Instance instance;
+        instance.messagesReceived = it.value()->messagesReceived.load(std::memory_order_relaxed);
+        instance.bytesReceived = it.value()->bytesReceived.load(std::memory_order_relaxed);
+        result.instances.insert(it.key(), instance);
+    }
+
+    return result;
+}
+
+void SingleApplicationPrivate::setIpcStatsInterval(int msecs)
+{
+    Q_Q(SingleApplication);
+
+    if (msecs <= 0) {
+        delete statsTimer;
+        statsTimer = nullptr;
+        return;
+    }
+
+    if (statsTimer == nullptr) {
+        statsTimer = new QTimer(this);
+        connect(statsTimer, &QTimer::timeout, this, [this, q](){
+            Q_EMIT q->ipcStatsUpdated(ipcStats());
+        });
+    }
+    statsTimer->start(msecs);
+}
+
+void SingleApplicationPrivate::setBackoffLimits(int initialDelay, int maximumDelay)
+{
+    m_initialBackoff = qMax(1, initialDelay);
+    m_maximumBackoff = qMax(m_initialBackoff, maximumDelay);
+}
+
+int SingleApplicationPrivate::nextBackoff(int &attempt)
+{
+    // Equal jitter: the delay doubles with every consecutive collision and is
+    // picked from the upper half of that range.
+    const int ceiling = static_cast<int>(
+        qMin<qint64>(m_maximumBackoff, static_cast<qint64>(m_initialBackoff) << qMin(attempt, 16)));
+    ++attempt;
 #if (QT_VERSION >= QT_VERSION_CHECK(5, 10, 0))
-    QThread::msleep(QRandomGenerator::global()->bounded(8u, 18u));
+    return ceiling / 2 + static_cast<int>(QRandomGenerator::global()->bounded(ceiling / 2 + 1));
 #else
     qsrand(QDateTime::currentMSecsSinceEpoch() % std::numeric_limits<uint>::max());
-    QThread::msleep(qrand() % 11 + 8);
+    return ceiling / 2 + qrand() % (ceiling / 2 + 1);
 #endif
 }
 
+void SingleApplicationPrivate::backoff(int &attempt, qint64 maxMsecs)
+{
+    qint64 delay = nextBackoff(attempt);
+    if (maxMsecs >= 0)
+        delay = qMin(delay, maxMsecs);
+    if (delay <= 0)
+        return;
+
+    QThread::msleep(static_cast<unsigned long>(delay));
+    backoffTime.fetch_add(delay, std::memory_order_relaxed);
+}
+
+void SingleApplicationPrivate::logStartupTimings() const
+{
+    // One line of key=value pairs in nanoseconds, simple to collect and parse
+    qCDebug(lcSingleApplicationStartup).nospace().noquote()
+        << "SingleApplication: startup"
+        << " role=" << (server != nullptr ? "primary" : "secondary")
+        << " total=" << startupTimings.total
+        << " blockName=" << startupTimings.blockName
+        << " staleBlockCleanup=" << startupTimings.staleBlockCleanup
+        << " blockAcquire=" << startupTimings.blockAcquire
+        << " lockWait=" << startupTimings.lockWait
+        << " consistencyWait=" << startupTimings.consistencyWait
+        << " backoff=" << startupTimings.backoff
+        << " serverStart=" << startupTimings.serverStart
+        << " connect=" << startupTimings.connect;
+}
+
 void SingleApplicationPrivate::addAppData(const QString &data)
 {
     appDataList.push_back(data);
@@ -32,10 +32,26 @@
 #pragma once
 
 #include "singleapplication.h"
+#include <QDeadlineTimer>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QLoggingCategory>
+#include <QMutex>
+#include <QSharedPointer>
+#include <atomic>
 
 QT_FORWARD_DECLARE_CLASS(QSharedMemory)
 QT_FORWARD_DECLARE_CLASS(QLocalServer)
 QT_FORWARD_DECLARE_CLASS(QLocalSocket)
+QT_FORWARD_DECLARE_CLASS(QTimer)
+QT_FORWARD_DECLARE_CLASS(QThread)
+QT_FORWARD_DECLARE_CLASS(QSemaphore)
+
+class PrimaryConnection;
+class IpcWorker;
+
+Q_DECLARE_LOGGING_CATEGORY(lcSingleApplicationStartup)
 
 struct InstancesInfo
 {
@@ -46,11 +62,221 @@ struct InstancesInfo
     quint16 checksum; // Must be the last field
 };
 
-struct ConnectionInfo
+// The layouts below start with a magic word telling them apart on attach. The
+// first word of the original layout is its primary flag, so either 0 or 1.
+static constexpr quint32 Crc32cBlockMagic = 0x53414331;        // SAC1
+static constexpr quint32 LockFreeBlockMagic = 0x53414C31;      // SAL1
+static constexpr quint32 InstanceTableBlockMagic = 0x53415431; // SAT1
+
+// Layout of the block used by SingleApplication::Mode::Crc32cChecksums. The
+// CRC-16 of the original layout is unused, the CRC32C covers the same fields.
+struct Crc32cInstancesInfo
+{
+    quint32 magic;
+    InstancesInfo info;
+    quint32 checksum;
+};
+
+// Layout of the block used by SingleApplication::Mode::LockFreeRegistry. All
+// zeroes is the valid initial state, a primaryPid of 0 means no primary. The
+// first instance to attach claims it by storing the magic.
+struct AtomicInstancesInfo
+{
+    std::atomic<quint32> magic;
+    std::atomic<quint32> sequence;
+    std::atomic<quint32> secondary;
+    std::atomic<quint32> primaryPid;
+    char primaryUser[128];
+};
+
+static_assert(std::atomic<quint32>::is_always_lock_free,
+              "The lock free registry requires lock free 32-bit atomics");
+
+// A slot of SingleApplication::Mode::InstanceTable, on its own cache line so
+// heartbeats of different instances don't contend. A pid of 0 means free,
+// a heartbeat of 0 that the owner is still filling it in.
+struct alignas(64) InstanceSlot
+{
+    std::atomic<quint32> pid;
+    std::atomic<quint32> instanceId;
+    std::atomic<qint64> startTime;
+    std::atomic<qint64> heartbeat;
+};
+
+// Layout of the block used by SingleApplication::Mode::InstanceTable, it
+// extends the block of the lock free registry. A version of 0 means the
+// table hasn't been initialised yet.
+struct InstanceTableInfo
 {
+    AtomicInstancesInfo registry;
+    alignas(64) std::atomic<quint32> version;
+    std::atomic<quint32> slotCount;
+    InstanceSlot entries[256];
+};
+
+static_assert(std::atomic<qint64>::is_always_lock_free,
+              "The instance table requires lock free 64-bit atomics");
+
+// Counters behind SingleApplication::IpcStats. They are only statistics and
+// are updated with relaxed atomics from whichever thread runs the channel.
+struct IpcCounters
+{
+    std::atomic<quint64> messagesSent = {0};
+    std::atomic<quint64> bytesSent = {0};
+    std::atomic<quint64> messagesReceived = {0};
+    std::atomic<quint64> bytesReceived = {0};
+    std::atomic<quint64> connectRetries = {0};
+    std::atomic<int> connections = {0};
+    std::atomic<quint64> ackLatency[SingleApplication::IpcStats::HistogramBuckets] = {};
+    std::atomic<quint64> frameLatency[SingleApplication::IpcStats::HistogramBuckets] = {};
+};
+
+struct InstanceCounters
+{
+    std::atomic<quint64> messagesReceived = {0};
+    std::atomic<quint64> bytesReceived = {0};
+};
+
+struct ConnectionInfo : public QEnableSharedFromThis<ConnectionInfo>
+{
+    QLocalSocket *socket = nullptr;
     qint64 msgLen = 0;
     quint32 instanceId = 0;
     quint8 stage = 0;
+    quint64 frameFlags = 0;
+    int pendingAcks = 0;
+    QByteArray buffer = {};
+    QSharedPointer<QSharedMemory> dataMemory = {};
+    quint64 dataSequence = 0;
+    bool extended = false;
+    QByteArray outgoing = {};
+    bool flushScheduled = false;
+    quint64 streamId = 0;
+    QSharedPointer<InstanceCounters> counters = {};
+    qint64 frameStart = 0;
+    qint64 budgeted = 0;
+    bool paused = false;
+    QString channel = {};
+    quint64 frameSequence = 0;
+    quint32 frameChecksum = 0;
+    bool frameChecksummed = false;
+    quint32 streamChecksum = 0;
+};
+
+// Header of the shared memory channel a secondary instance uses for large
+// messages. The message bytes follow it, tail is advanced by the primary.
+struct DataChannelHeader
+{
+    std::atomic<quint64> tail;
+};
+
+// Fixed layout header of the extended protocol, written and read with a
+// single copy. Multi-byte fields are little endian. The lowest bit of the
+// first byte is never set in the 8 byte big endian header, so the primary can
+// tell both apart per frame.
+struct FrameHeader
+{
+    quint8 magic;
+    quint8 version;
+    quint8 flags;
+    quint8 features;
+    quint32 checksum;
+    quint64 length;
+    quint64 sequence;
+};
+
+static_assert(sizeof(FrameHeader) == 24, "The frame header must not be padded");
+
+// A frame written to the primary which has not been acknowledged yet
+struct PendingAck
+{
+    quint64 messageId = 0;
+    qint64 bytes = 0;
+    qint64 written = 0;
+};
+
+struct AsyncMessage
+{
+    quint64 id = 0;
+    QByteArray payload = {};
+    QDeadlineTimer deadline = {};
+    quint64 frameFlags = 0;
+    quint8 framesWritten = 0;
+    bool notify = false;
+    bool blocking = false;
+    bool reported = false;
+    bool init = false;
+};
+
+// A call of the public API handed to the thread of SingleApplication::Mode::IpcThread
+struct IpcRequest
+{
+    enum class Kind : quint8 {
+        Connect,
+        Message,
+        AsyncMessage,
+        Flush,
+        PoolSize,
+        Listen,
+        InstanceMessage,
+        Broadcast,
+        Shutdown
+    };
+
+    std::atomic<IpcRequest *> next = {nullptr};
+    Kind kind = Kind::Message;
+    quint8 connectionType = 0;
+    int timeout = 0;
+    QByteArray message = {};
+    quint64 frameFlags = 0;
+    quint64 messageId = 0;
+    const QThread *sender = nullptr;
+    QString channel = {};
+    QSemaphore *done = nullptr;
+    bool result = false;
+    int delivered = 0;
+};
+
+// Intrusive multiple producer, single consumer queue. push() never blocks,
+// pop() is only called from the IPC thread and returns requests in the order
+// they have been pushed by each producer.
+class IpcRequestQueue
+{
+    Q_DISABLE_COPY_MOVE(IpcRequestQueue)
+
+public:
+    IpcRequestQueue();
+
+    void push(IpcRequest *request);
+    IpcRequest *pop();
+
+private:
+    std::atomic<IpcRequest *> head;
+    IpcRequest *tail;
+    IpcRequest stub;
+};
+
+// Handed from the IPC thread of a primary instance to the main thread
+struct ReceivedEvent
+{
+    enum class Kind : quint8 {
+        Message,
+        Batch,
+        InstanceStarted,
+        StreamStarted,
+        StreamChunk,
+        StreamFinished,
+        ChannelMessage
+    };
+
+    Kind kind = Kind::Message;
+    quint32 instanceId = 0;
+    QString channel = {};
+    QByteArray message = {};
+    QList<QByteArray> messages = {};
+    quint64 streamId = 0;
+    qint64 streamLength = 0;
+    bool complete = false;
 };
 
 class SingleApplicationPrivate : public QObject
@@ -72,44 +298,317 @@ public:
         StageInitHeader = 0,
         StageInitBody = 1,
         StageConnectedHeader = 2,
-        StageConnectedBody = 3
+        StageConnectedBody = 3,
+        StageConnectedStream = 4
     };
     Q_ENUM(ConnectionStage)
 
+    // The most significant bit of a frame header marks a frame of the extended
+    // protocol: the header is not acknowledged and the body is acknowledged
+    // together with every other message received in the same batch.
+    static constexpr quint64 PipelinedFrame = Q_UINT64_C(1) << 63;
+    // The body of the frame describes a message in the shared memory channel
+    static constexpr quint64 SharedMemoryFrame = Q_UINT64_C(1) << 62;
+    // The body of the frame is the session token of a previous connection
+    // and replaces the init message.
+    static constexpr quint64 ResumeFrame = Q_UINT64_C(1) << 61;
+    // The body of the frame is a serialised list of messages
+    static constexpr quint64 BatchFrame = Q_UINT64_C(1) << 60;
+    // The init message is followed by the first message of the instance
+    static constexpr quint64 InitPayloadFrame = Q_UINT64_C(1) << 59;
+    // The body of the frame, or the message it describes, is compressed with
+    // qCompress()
+    static constexpr quint64 CompressedFrame = Q_UINT64_C(1) << 58;
+    // The init message is followed by the name of the channel the connection
+    // carries
+    static constexpr quint64 ChannelFrame = Q_UINT64_C(1) << 57;
+    // The lowest bit of the flags is reserved, it marks a FrameHeader
+    static constexpr quint64 FrameFlagsMask = Q_UINT64_C(0xFF) << 56;
+    static constexpr int MaxPendingAcks = 64;
+    static constexpr int MaximumCreateAttempts = 8;
+    static constexpr int MaximumSeqlockAttempts = 1000;
+    static constexpr quint64 MinimumDataChannelSize = 8 * 1024 * 1024;
+    static constexpr int MaximumSessions = 1024;
+    static constexpr qint64 MaximumStreamChunk = 1024 * 1024;
+    static constexpr qint64 PausedReadBufferSize = sizeof(FrameHeader);
+    static constexpr quint32 BlockNameCacheVersion = 1;
+    static constexpr quint32 InstanceTableVersion = 1;
+    static constexpr int HeartbeatInterval = 1000;
+
+    // Records sent from the primary to a secondary instance
+    static constexpr char AckRecord = '\n';
+    static constexpr char SessionRecord = 'T';
+    static constexpr char MessageRecord = 'M';
+    // Followed by the receive budget and the streaming threshold
+    static constexpr char CreditRecord = 'C';
+    // Followed by the version of the frame header the primary understands
+    static constexpr char ProtocolRecord = 'P';
+    static constexpr quint8 FrameMagic = 'S';
+    static constexpr quint8 FrameVersion = 1;
+    // FrameHeader::checksum holds the CRC32C of the frame body
+    static constexpr quint8 FrameChecksummed = 0x01;
+
     explicit SingleApplicationPrivate(SingleApplication *q_ptr);
     ~SingleApplicationPrivate() override;
 
     static QString getUsername();
+    QString username() const;
+    static quint64 currentUid();
     void genBlockServerName();
+    static QString blockNameCachePath(const QByteArray &cacheKey);
+    static qint64 binaryModificationTime();
+    bool readBlockNameCache(const QString &path);
+    void writeBlockNameCache(const QString &path) const;
+    bool isLockFree() const;
+    int blockSize() const;
+    AtomicInstancesInfo *atomicInstances() const;
+    InstanceTableInfo *instanceTable() const;
+    void claimInstanceSlot();
+    void releaseInstanceSlot();
+    void writeHeartbeat() const;
+    QList<SingleApplication::RunningInstance> runningInstances() const;
+    bool lockMemory() const;
+    bool unlockMemory() const;
+    bool isBlockConsistent() const;
+    bool isBlockLayoutCompatible() const;
+    quint32 blockMagic() const;
+    bool isBlockZeroFilled() const;
+    InstancesInfo *instancesInfo() const;
     void initializeMemoryBlock() const;
+    bool recoverMemoryBlock() const;
+    bool claimPrimary() const;
+    bool releaseStalePrimary(int msecs);
+    static bool isProcessAlive(qint64 pid);
+    void writePrimaryUser(const QByteArray &username) const;
     void startPrimary();
+    void startServer();
+    void stopServer();
+    QObject *ipcContext();
     void startSecondary();
+    QByteArray initMessage(ConnectionType connectionType) const;
+    PrimaryConnection *connection(const QThread *sender = nullptr);
     bool connectToPrimary(int msecs, ConnectionType connectionType);
-    quint16 blockChecksum() const;
+    bool handOffToPrimary(int msecs);
+    bool sendMessage(const QByteArray &message, int msecs, quint64 flags = 0);
+    bool sendMessages(const QList<QByteArray> &messages, int msecs);
+    bool sendChannelMessage(const QString &channel, const QByteArray &message, int msecs);
+    PrimaryConnection *channelConnection(const QString &channel);
+    quint64 sendMessageAsync(const QByteArray &message, int msecs);
+    void setConnectionPoolSize(int size);
+    bool flushMessages(int msecs);
+    bool flushConnections(int msecs);
+    void resizeConnectionPool(int size);
+    bool isIpcThreadCaller(const char *function) const;
+    void startIpcThread();
+    void stopIpcThread();
+    bool submitRequest(IpcRequest &request);
+    void postRequest(IpcRequest *request);
+    void processRequests();
+    void processRequest(IpcRequest *request);
+    quint32 blockChecksum() const;
+    quint32 storedBlockChecksum() const;
+    void writeBlockChecksum() const;
+    static quint32 crc32c(const void *data, size_t length, quint32 crc = 0);
     qint64 primaryPid() const;
     QString primaryUser() const;
-    bool isFrameComplete(QLocalSocket *sock);
-    void readMessageHeader(QLocalSocket *socket, ConnectionStage nextStage);
-    void readInitMessageBody(QLocalSocket *socket);
-    void writeAck(QLocalSocket *sock);
-    bool writeConfirmedFrame(int msecs, const QByteArray &msg);
-    bool writeConfirmedMessage(int msecs, const QByteArray &msg);
-    static void randomSleep();
+    static bool isFrameComplete(const ConnectionInfo &info);
+    bool readMessageHeader(ConnectionInfo &info, ConnectionStage nextStage);
+    bool readInitMessageBody(ConnectionInfo &info);
+    bool readResumeMessageBody(ConnectionInfo &info);
+    void writeSessionToken(ConnectionInfo &info);
+    void writeCredit(ConnectionInfo &info);
+    void writeProtocolVersion(ConnectionInfo &info);
+    bool acquireBudget(ConnectionInfo &info);
+    void releaseBudget(ConnectionInfo &info, qint64 bytes);
+    void resumeConnections();
+    QByteArray readFrameBody(ConnectionInfo &info) const;
+    void readFrames(ConnectionInfo &info);
+    bool slotDataAvailable(ConnectionInfo &info);
+    void startStream(ConnectionInfo &info);
+    bool readStreamChunk(ConnectionInfo &info);
+    void slotClientConnectionClosed(ConnectionInfo &info);
+    void writeAck(ConnectionInfo &info);
+    void registerConnection(ConnectionInfo &info);
+    bool sendMessageToInstance(quint32 instanceId, const QByteArray &message);
+    int broadcastMessage(const QByteArray &message);
+    bool writeInstanceMessage(quint32 instanceId, const QByteArray &message);
+    int writeBroadcastMessage(const QByteArray &message);
+    void queueMessageRecord(ConnectionInfo &info, const QByteArray &message);
+    void emitInstanceStarted();
+    void emitReceivedMessage(quint32 instanceId, QByteArray &&message);
+    void emitReceivedMessages(quint32 instanceId, QList<QByteArray> &&messages);
+    void emitChannelMessage(quint32 instanceId, const QString &channel, QByteArray &&message);
+    void deliverMessages(quint32 instanceId, QList<QByteArray> &&messages);
+    void setCoalescingWindow(int msecs, int maxMessages);
+    bool isCoalescing() const;
+    void coalesceMessage(quint32 instanceId, QByteArray &&message);
+    void flushCoalescedMessages();
+    void postReceivedEvent(ReceivedEvent &&event);
+    void emitStreamEvent(ReceivedEvent &&event);
+    void deliverReceivedEvent(ReceivedEvent &event);
+    static QByteArray frameHeader(qint64 length, quint64 flags);
+    bool readSharedMemoryFrame(ConnectionInfo &info, QByteArray &message, quint64 &dataTail) const;
+    static qint64 maximumInflatedSize(qint64 budget);
+    void compressMessage(QByteArray &message, quint64 &flags, qint64 budget) const;
+    static void recordLatency(std::atomic<quint64> *histogram, qint64 nsecs);
+    void countReceived(ConnectionInfo &info, quint64 messages, quint64 bytes);
+    SingleApplication::IpcStats ipcStats() const;
+    void setIpcStatsInterval(int msecs);
+    static void setBackoffLimits(int initialDelay, int maximumDelay);
+    static int nextBackoff(int &attempt);
+    void backoff(int &attempt, qint64 maxMsecs = -1);
+    void logStartupTimings() const;
     void addAppData(const QString &data);
     QStringList appData() const;
 
     SingleApplication *q_ptr = nullptr;
     QSharedMemory *memory = nullptr;
-    QLocalSocket *socket = nullptr;
+    InstanceSlot *instanceSlot = nullptr;
+    QTimer *heartbeatTimer = nullptr;
     QLocalServer *server = nullptr;
     quint32 instanceNumber = 0;
+    int timeout = 0;
+    QList<PrimaryConnection *> connections = {};
+    QHash<const QThread *, PrimaryConnection *> threadConnections = {};
+    QHash<QString, PrimaryConnection *> channelConnections = {};
+    QThread *ipcThread = nullptr;
+    IpcWorker *ipcWorker = nullptr;
+    IpcRequestQueue ipcRequests;
+    std::atomic<bool> ipcWakePending = {false};
+    QMutex receivedMutex;
+    QList<ReceivedEvent> receivedEvents = {};
+    std::atomic<quint64> lastMessageId = {0};
+    quint64 sessionToken = 0;
+    QHash<quint64, quint32> sessions = {};
+    QMultiHash<quint32, QWeakPointer<ConnectionInfo>> instanceConnections = {};
+    std::atomic<qint64> backoffTime = {0};
+    SingleApplication::StartupTimings startupTimings = {};
+    qint64 sharedMemoryThreshold = 0;
+    qint64 compressionThreshold = 0;
+    qint64 streamingThreshold = 0;
+    quint64 lastStreamId = 0;
+    IpcCounters *stats = nullptr;
+    QElapsedTimer statsClock;
+    mutable QMutex statsMutex;
+    QHash<quint32, QSharedPointer<InstanceCounters>> instanceCounters = {};
+    QTimer *statsTimer = nullptr;
+    int coalesceWindow = 0;
+    int coalesceCount = 0;
+    QList<QPair<quint32, QByteArray>> coalescedMessages = {};
+    QTimer *coalesceTimer = nullptr;
+    qint64 receiveBudget = 0;
+    qint64 totalReceiveBudget = 0;
+    qint64 bufferedBytes = 0;
+    bool resumeScheduled = false;
+    QList<QWeakPointer<ConnectionInfo>> pausedConnections = {};
+    std::atomic<int> lastSendError = {0};
+    quint32 dataGeneration = 0;
     QString blockServerName = {};
+    mutable QString cachedUsername = {};
+    QByteArray initPayload = {};
+    bool hasInitPayload = false;
     SingleApplication::Options options = {};
-    QMap<QLocalSocket *, ConnectionInfo> connectionMap = {};
     QStringList appDataList = {};
 
 public Q_SLOTS:
     void slotConnectionEstablished();
-    void slotDataAvailable(QLocalSocket *, quint32);
-    void slotClientConnectionClosed(QLocalSocket *, quint32);
+    void deliverReceivedEvents();
+};
+
+// A connection of a secondary instance to the primary instance, which stays
+// open for every following message.
+class PrimaryConnection : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY_MOVE(PrimaryConnection)
+
+public:
+    enum class DataChannelResult : quint8 {
+        Written,
+        Full,
+        Unavailable
+    };
+
+    enum class FrameResult : quint8 {
+        Written,
+        WouldBlock,
+        OverBudget
+    };
+
+    explicit PrimaryConnection(SingleApplicationPrivate *d, const QString &channel = {});
+    ~PrimaryConnection() override;
+
+    void open();
+    QByteArray initMessage(SingleApplicationPrivate::ConnectionType connectionType, quint64 &flags);
+    bool connectToPrimary(int msecs, SingleApplicationPrivate::ConnectionType connectionType, bool retry = true);
+    bool sendMessage(const QByteArray &message, int msecs, quint64 flags = 0);
+    bool writeConfirmedFrame(int msecs, const QByteArray &msg);
+    bool writeConfirmedMessage(int msecs, const QByteArray &msg, quint64 flags = 0);
+    bool writePipelinedMessage(int msecs, const QByteArray &msg, quint64 flags);
+    FrameResult writePipelinedFrame(const QByteArray &msg, quint64 flags, quint64 messageId);
+    DataChannelResult writeSharedMemoryFrame(const QByteArray &msg, quint64 flags, quint64 messageId);
+    bool createDataChannel(quint64 minimumCapacity);
+    quint64 dataCapacity() const;
+    void consumeAcks();
+    void consumeAck();
+    bool waitForAcks(int msecs, int maxPending);
+    quint64 queueAsyncMessage(const QByteArray &msg, int msecs, bool notify, quint64 messageId = 0, quint64 flags = 0);
+    bool waitForAsyncMessage(quint64 messageId, int msecs);
+    bool flushMessages(int msecs);
+    bool hasAsyncMessages() const;
+    void expireAsyncMessages(quint64 messageId = 0);
+    void finishAsyncMessage(const AsyncMessage &message, bool ok);
+    void expectAck(quint64 messageId, qint64 bytes);
+    qint64 frameHeaderSize() const;
+    void writeFrameHeader(const QByteArray &body, quint64 flags);
+    void countSent(qint64 bytes);
+
+    SingleApplicationPrivate *d = nullptr;
+    QString channel = {};
+    QLocalSocket *socket = nullptr;
+    QByteArray incoming = {};
+    QList<PendingAck> awaitingAcks = {};
+    // Unacknowledged frames were dropped with the connection since the last
+    // flushMessages()
+    bool lostFrames = false;
+    qint64 bytesInFlight = 0;
+    // Bytes the primary accepts in flight, 0 is unlimited and -1 unknown
+    // until the init message is acknowledged.
+    qint64 credit = -1;
+    // Messages from this size are streamed by the primary and may exceed the
+    // credit, 0 if it doesn't stream
+    qint64 streamingThreshold = 0;
+    SingleApplication::SendError sendError = SingleApplication::SendError::NoError;
+    bool compactHeaders = false;
+    quint64 frameSequence = 0;
+    QList<AsyncMessage> asyncMessages = {};
+    QHash<quint64, bool> blockingResults = {};
+    QTimer *asyncTimer = nullptr;
+    bool asyncConnecting = false;
+    bool resuming = false;
+    int asyncAttempt = 0;
+    QSharedMemory *dataMemory = nullptr;
+    quint64 dataHead = 0;
+    quint64 dataSequence = 0;
+
+public Q_SLOTS:
+    void slotAcksAvailable();
+    void slotSocketStateChanged();
+    void pumpAsyncMessages();
+};
+
+// Lives in the thread of SingleApplication::Mode::IpcThread and owns every
+// connection to the primary instance.
+class IpcWorker : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY_MOVE(IpcWorker)
+
+public:
+    explicit IpcWorker(SingleApplicationPrivate *d) : d(d) {}
+
+    SingleApplicationPrivate *d = nullptr;
+
+public Q_SLOTS:
+    void processRequests() { d->processRequests(); }
 };